@@ -0,0 +1,272 @@
+/* bench_editor.c
+ * Headless benchmark for mini_nano.c. It opens synthetic files of the given
+ * sizes and replays key scripts through the editor's own input path (a
+ * thread feeds them into a pipe on stdin) with frames going to /dev/null:
+ * typing, newline storms, bracketed pastes, scrolling, undo and save. Each
+ * key is one op: decode, edit, scroll and a full frame. It reports ops/sec,
+ * latency percentiles per op and the peak RSS of each size, which runs in
+ * a child process of its own.
+ * Build and run (from assembly/):
+ *   gcc -O2 bench_editor.c -o bench_editor -pthread
+ *   ./bench_editor [-o frames.out] [-s keys.script] [size ...]
+ *                                 e.g. 1K 1M 100M (the default) 4G
+ * -o captures the frames instead of dropping them; -s replays a recorded
+ * key script (raw terminal input, e.g. saved with `cat > keys.script`) as
+ * one more scenario. The test files are created in $TMPDIR (or /tmp) and
+ * removed afterwards.
+ */
+
+#define MINI_NANO_NO_MAIN
+#include "mini_nano.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+FILE *report;               // stdout before it became the frame sink
+const char *sinkpath = "/dev/null";
+const char *scriptpath;
+
+size_t parseSize(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    switch (*end) {
+        case 'k': case 'K': v *= 1024; break;
+        case 'm': case 'M': v *= 1024 * 1024; break;
+        case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+    }
+    return (size_t)v;
+}
+
+/* Log-like lines of 0..160 bytes with a tab now and then */
+int makeFile(char *path, size_t size) {
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, 512, "%s/mini_nano_bench_XXXXXX", dir && dir[0] ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1) return -1;
+
+    static char chunk[1 << 20];
+    unsigned seed = 12345;
+    size_t written = 0;
+    while (written < size) {
+        size_t n = 0;
+        while (n < sizeof(chunk) - 200) {
+            seed = seed * 1103515245 + 12345;
+            int len = (seed >> 16) % 161;
+            for (int i = 0; i < len; i++) chunk[n++] = i % 23 == 22 ? '\t' : 'a' + (i * 7 + len) % 26;
+            chunk[n++] = '\n';
+        }
+        if (n > size - written) n = size - written;
+        if (write(fd, chunk, n) != (ssize_t)n) { close(fd); unlink(path); return -1; }
+        written += n;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Key scripts */
+void scriptAdd(struct abuf *ab, const char *s) {
+    abAppend(ab, s, strlen(s));
+}
+
+void scriptRepeat(struct abuf *ab, const char *s, int n) {
+    for (int i = 0; i < n; i++) scriptAdd(ab, s);
+}
+
+void scriptType(struct abuf *ab, int n) {
+    for (int i = 0; i < n; i++) {
+        char c = i % 61 == 60 ? '\r' : i % 7 == 6 ? ' ' : 'a' + i % 26;
+        abAppend(ab, &c, 1);
+    }
+}
+
+void scriptPaste(struct abuf *ab, int n, int size) {
+    for (int i = 0; i < n; i++) {
+        scriptAdd(ab, "\x1b[200~");
+        for (int j = 0; j < size; j++) {
+            char c = j % 73 == 72 ? '\n' : 'A' + j % 26;
+            abAppend(ab, &c, 1);
+        }
+        scriptAdd(ab, "\x1b[201~");
+    }
+}
+
+int readScript(const char *path, struct abuf *ab) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) abAppend(ab, buf, n);
+    fclose(fp);
+    return 0;
+}
+
+/* The key feeder: writes a script into the pipe the editor reads as stdin */
+struct feeder {
+    int fd;
+    const char *s;
+    size_t len;
+};
+
+void *feedKeys(void *arg) {
+    struct feeder *f = arg;
+    size_t off = 0;
+    while (off < f->len) {
+        ssize_t n = write(f->fd, f->s + off, f->len - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    return NULL;
+}
+
+void formatNs(char *buf, size_t bufsz, unsigned long ns) {
+    if (ns < 10000) snprintf(buf, bufsz, "%luns", ns);
+    else editorFormatUs(buf, bufsz, ns / 1000);
+}
+
+/* Replay a script against the open file; every key is timed up to its frame */
+void runScript(const char *name, struct abuf *keys, int collect) {
+    static struct histogram h;
+    memset(&h, 0, sizeof(h));
+    int p[2];
+    if (pipe(p) == -1) die("pipe");
+    dup2(p[0], STDIN_FILENO);
+    close(p[0]);
+    in.head = in.tail = 0;
+    struct feeder f = {p[1], keys->b, keys->len};
+    pthread_t t;
+    if (pthread_create(&t, NULL, feedKeys, &f) != 0) die("pthread_create");
+
+    long long start = monotonicUs();
+    while (in.head != (unsigned)keys->len) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        editorProcessKeypress();
+        editorScroll();
+        if (collect) editorSaveCollect(1);
+        editorRefreshScreen();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        histRecord(&h, (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec));
+    }
+    double secs = (monotonicUs() - start) / 1e6;
+    pthread_join(t, NULL);
+    close(p[1]);
+
+    char p50[16], p99[16], max[16];
+    formatNs(p50, sizeof(p50), histPercentile(&h, 0.5));
+    formatNs(p99, sizeof(p99), histPercentile(&h, 0.99));
+    formatNs(max, sizeof(max), atomic_load(&h.max));
+    fprintf(report, "  %-8s %8lu ops %11.0f ops/s   p50 %8s  p99 %8s  max %8s\n", name,
+            (unsigned long)h.n, h.n / secs, p50, p99, max);
+    fflush(report);
+}
+
+/* Open the test file afresh, dropping the edits of the last scenario */
+void reopen(const char *path, double *secs) {
+    E.dirty = 0;
+    swapClose(1);
+    long long t0 = monotonicUs();
+    editorOpen(path);
+    editorLoadAll();
+    if (secs) *secs = (monotonicUs() - t0) / 1e6;
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+}
+
+void benchSize(const char *label, size_t size) {
+    char path[512];
+    if (makeFile(path, size) == -1) { perror("creating test file"); exit(1); }
+
+    initEditor();
+    editorSetSize(24, 80);
+    double secs;
+    reopen(path, &secs);
+    fprintf(report, "%s (%zu bytes, %d lines): open %.1f ms, %.0f MB/s\n", label, size, E.numrows,
+            secs * 1000, secs > 0 ? size / secs / 1e6 : 0);
+
+    struct abuf keys = ABUF_INIT;
+    E.cy = E.numrows / 2;
+    scriptType(&keys, 20000);
+    runScript("type", &keys, 0);
+
+    keys.len = 0;
+    scriptRepeat(&keys, "\x1a", 200); // undo it again, a group at a time
+    runScript("undo", &keys, 0);
+
+    reopen(path, NULL);
+    E.cy = E.numrows / 2;
+    keys.len = 0;
+    scriptRepeat(&keys, "\r", 5000);
+    runScript("newline", &keys, 0);
+
+    reopen(path, NULL);
+    keys.len = 0;
+    scriptPaste(&keys, 20, 16 * 1024);
+    runScript("paste", &keys, 0);
+
+    reopen(path, NULL);
+    keys.len = 0;
+    scriptRepeat(&keys, "\x1b[6~", 2000);
+    scriptRepeat(&keys, "\x1b[A", 2000);
+    scriptRepeat(&keys, "\x1b[1;5F\x1b[1;5H", 200);
+    runScript("scroll", &keys, 0);
+
+    if (scriptpath) {
+        keys.len = 0;
+        if (readScript(scriptpath, &keys) == -1) { perror(scriptpath); exit(1); }
+        runScript("script", &keys, 0);
+    }
+
+    // last, as it rewrites the file
+    reopen(path, NULL);
+    keys.len = 0;
+    scriptRepeat(&keys, "x\x13", 3);
+    runScript("save", &keys, 1);
+
+    E.dirty = 0;
+    swapClose(1);
+    editorFreeRows();
+    unlink(path);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(report, "  peak RSS %.1f MB\n", ru.ru_maxrss / 1024.0);
+    fflush(report);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:")) != -1) {
+        if (opt == 'o') sinkpath = optarg;
+        else if (opt == 's') scriptpath = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-o frames.out] [-s keys.script] [size ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    const char *defaults[] = {"1K", "1M", "100M"};
+    int nsizes = optind < argc ? argc - optind : 3;
+    const char **sizes = optind < argc ? (const char **)argv + optind : defaults;
+
+    // frames go to the sink; the report keeps the real stdout
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    int sink = open(sinkpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (report == NULL || sink == -1) { perror(sinkpath); return 1; }
+    dup2(sink, STDOUT_FILENO);
+    close(sink);
+
+    for (int s = 0; s < nsizes; s++) {
+        fflush(report);
+        pid_t pid = fork();
+        if (pid == -1) { perror("fork"); return 1; }
+        if (pid == 0) {
+            benchSize(sizes[s], parseSize(sizes[s]));
+            exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(report, "%s: failed\n", sizes[s]);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+/* bench_lineindex.c
+ * Micro-benchmark for the line indexer in mini_nano.c. It times the getline
+ * loop editorOpen used to run against every lineIndexScan implementation
+ * built for this CPU, on synthetic files of the given sizes.
+ * Build and run (from assembly/):
+ *   gcc -O2 bench_lineindex.c -o bench_lineindex -pthread
+ *   ./bench_lineindex [size ...]     e.g. 1M 100M 1G (the default)
+ * The test files are created in $TMPDIR (or /tmp) and removed afterwards.
+ */
+
+#define MINI_NANO_NO_MAIN
+#include "mini_nano.c"
+
+struct result {
+    size_t lines;
+    size_t bytes;   // line bytes after stripping '\r' / '\n'
+};
+
+double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+size_t parseSize(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    switch (*end) {
+        case 'k': case 'K': v *= 1024; break;
+        case 'm': case 'M': v *= 1024 * 1024; break;
+        case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+    }
+    return (size_t)v;
+}
+
+/* Log-like lines of 0..160 bytes, one in sixteen ending in "\r\n" */
+int makeFile(char *path, size_t size) {
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, 512, "%s/mini_nano_bench_XXXXXX", dir && dir[0] ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1) return -1;
+
+    static char chunk[1 << 20];
+    unsigned seed = 12345;
+    size_t written = 0;
+    while (written < size) {
+        size_t n = 0;
+        while (n < sizeof(chunk) - 200) {
+            seed = seed * 1103515245 + 12345;
+            int len = (seed >> 16) % 161;
+            for (int i = 0; i < len; i++) chunk[n++] = 'a' + (i * 7 + len) % 26;
+            if (((seed >> 8) & 15) == 0) chunk[n++] = '\r';
+            chunk[n++] = '\n';
+        }
+        if (n > size - written) n = size - written;
+        if (write(fd, chunk, n) != (ssize_t)n) { close(fd); unlink(path); return -1; }
+        written += n;
+    }
+    return fd;
+}
+
+struct result benchGetline(const char *path) {
+    struct result r = {0, 0};
+    FILE *fp = fopen(path, "r");
+    if (!fp) return r;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) len--;
+        r.lines++;
+        r.bytes += len;
+    }
+    free(line);
+    fclose(fp);
+    return r;
+}
+
+/* The same walk editorOpenMapped does, minus creating rows */
+struct result benchIndex(const char *map, size_t len, lineIndexFn fn) {
+    struct result r = {0, 0};
+    size_t nl[4096];
+    size_t start = 0, off = 0;
+    while (off < len) {
+        size_t scanned;
+        size_t n = fn(map + off, len - off, off, nl, 4096, &scanned);
+        for (size_t i = 0; i < n; i++) {
+            size_t end = nl[i];
+            while (end > start && map[end-1] == '\r') end--;
+            r.lines++;
+            r.bytes += end - start;
+            start = nl[i] + 1;
+        }
+        off += scanned;
+    }
+    if (start < len) {
+        size_t end = len;
+        while (end > start && map[end-1] == '\r') end--;
+        r.lines++;
+        r.bytes += end - start;
+    }
+    return r;
+}
+
+void report(const char *name, double secs, size_t size, struct result r, struct result ref) {
+    printf("  %-8s %9.2f ms %8.2f GB/s  %zu lines%s\n", name, secs * 1000,
+           size / secs / 1e9, r.lines,
+           r.lines == ref.lines && r.bytes == ref.bytes ? "" : "  MISMATCH");
+}
+
+int main(int argc, char *argv[]) {
+    const char *defaults[] = {"1M", "100M", "1G"};
+    int nsizes = argc > 1 ? argc - 1 : 3;
+    const char **sizes = argc > 1 ? (const char **)argv + 1 : defaults;
+
+    struct lineIndexImpl impls[4];
+    int nimpls = lineIndexImpls(impls);
+
+    for (int s = 0; s < nsizes; s++) {
+        size_t size = parseSize(sizes[s]);
+        char path[512];
+        int fd = makeFile(path, size);
+        if (fd == -1) { perror("creating test file"); return 1; }
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) { perror("mmap"); unlink(path); return 1; }
+
+        printf("%s (%zu bytes):\n", sizes[s], size);
+        benchGetline(path); // warm the page cache
+
+        double t = nowSeconds();
+        struct result ref = benchGetline(path);
+        report("getline", nowSeconds() - t, size, ref, ref);
+
+        for (int i = 0; i < nimpls; i++) {
+            if (!impls[i].supported) continue;
+            benchIndex(map, size, impls[i].fn);
+            t = nowSeconds();
+            struct result r = benchIndex(map, size, impls[i].fn);
+            report(impls[i].name, nowSeconds() - t, size, r, ref);
+        }
+
+        munmap(map, size);
+        close(fd);
+        unlink(path);
+    }
+    return 0;
+}
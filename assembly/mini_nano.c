@@ -1,18 +1,41 @@
 /* mini_nano.c
  * A tiny terminal text editor (nano-like) for learning and quick edits.
- * POSIX only (uses termios). Build with: gcc mini_nano.c -o mini_nano
+ * POSIX only (uses termios). Build with: gcc mini_nano.c -o mini_nano -pthread
+ * Run as mini_nano [file ...], or mini_nano -R file to page through a file
+ * of any size read-only (q quits, / searches, g / G: start / end). -m first
+ * lets clicks and the wheel through to the editor (the terminal's own
+ * selection then needs Shift held).
+ * Alt-F (F in the pager) follows a growing file, like tail -f.
+ * mini_nano --batch script file... edits files with no terminal (the
+ * script commands are listed at "Batch mode" below).
  * Controls:
  *  Ctrl-S : Save (prompts for filename if needed)
  *  Ctrl-O : Open file (prompts for filename)
  *  Ctrl-X : Exit (prompts to save if modified)
- *  Arrow keys : Move cursor
- *  Backspace / Delete : Remove characters
+ *  Arrow keys : Move cursor (Ctrl: by word)
+ *  Home / End / PgUp / PgDn : Line start / end (Ctrl: file), full screen
+ *  Backspace / Delete : Remove the character before / under the cursor
  *  Enter : New line
+ *  Ctrl-W : Search (arrows: previous / next match)
+ *  Ctrl-R : Replace all
+ *  Ctrl-G : Go to line (line[,column])
+ *  Alt-N : Toggle line numbers
+ *  Ctrl-Z : Undo
+ *  Ctrl-Y : Redo
+ *  Ctrl-D : Toggle debug info in the status bar
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,41 +44,397 @@
 #else
 #include <windows.h>
 #endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
-/* Simple dynamic row (line) structure */
+/* A row (line) is a gap buffer: the text is chars[0..gap) followed by
+ * chars[gap + (cap - size)..cap). Edits move the gap to the cursor, so
+ * typing in place costs no memmove and no allocation until the gap is full. */
 typedef struct erow {
-    int size;
+    int size;           // characters in the row, not counting the gap
+    int cap;            // bytes allocated for chars
+    int gap;            // gap start
+    int flags;
     char *chars;
+    struct rowrender *render;   // display form, built on demand (see rowRender)
 } erow;
 
+#define ROW_MAPPED 1    // chars points into the file mapping (read-only, cap == size)
+#define ROW_SHARED 2    // chars may be referenced by a save in progress
+#define ROW_PLAIN 4     // printable ASCII only: draws as it is, columns are bytes
+#define ROW_HLOK 8      // the lexer states below were found from the current text
+// lexer state at the start and at the end of the row, kept in flags (see hlSync)
+#define ROW_HL_START(row) (((row)->flags >> 16) & 0xff)
+#define ROW_HL_END(row) (((row)->flags >> 24) & 0x7f)
+
+/* How a row with tabs, control characters or UTF-8 looks on screen: the
+ * display bytes and, for every byte of the row, the screen column and the
+ * render offset it starts at (size + 1 entries each) */
+typedef struct rowrender {
+    int cap;            // as allocated from the arena
+    int rsize;          // screen columns
+    int rlen;           // bytes in render
+    int *rx;
+    int *ri;
+    char *render;       // after the two maps, which keeps them int-aligned
+    int maps[];
+} rowrender;
+
+/* Row text lives in a per-document arena. Buffers of up to ARENA_SMALL_MAX
+ * bytes are rounded up to a power-of-two size class and carved from 1 MB
+ * blocks; freed ones go on their class's free list for reuse. Bigger ones
+ * are malloc'd behind a header that links them to the arena. Either way the
+ * whole arena is released in one pass when the document goes away. */
+#define ARENA_BLOCK (1 << 20)
+#define ARENA_MIN_SHIFT 4       // smallest class: 16 bytes
+#define ARENA_CLASSES 8         // 16 .. 2048
+#define ARENA_SMALL_MAX (1 << (ARENA_MIN_SHIFT + ARENA_CLASSES - 1))
+
+typedef struct arenablock {
+    struct arenablock *next;
+    size_t used;                // bytes handed out from data
+    char data[];
+} arenablock;
+
+typedef struct arenabig {
+    struct arenabig *prev, *next;
+    size_t size;
+} arenabig;
+
+typedef struct arena {
+    arenablock *blocks;         // newest first; only the head has room left
+    void *freelist[ARENA_CLASSES];
+    arenabig *big;
+    size_t used;                // bytes in live allocations
+    size_t reserved;            // bytes obtained from malloc
+    int nbig;
+    int pinned;                 // a save is reading row text: defer frees
+    struct arenaptr { void *p; int cap; } *deferred;
+    int ndeferred, deferredcap;
+    size_t churn;               // bytes freed since the last compaction
+    char **victims;             // blocks the compactor is emptying, sorted by address
+    int nvictims;
+} arena;
+
+/* Undo history is a log of records: text inserted or deleted at (row, col),
+ * with '\n' where it crosses a line break. Records sit back to back in
+ * chunks from the document arena, so logging an edit does not malloc. The
+ * records of one command share a group; undo and redo apply a group at a
+ * time, in time proportional to its text. */
+#ifndef UNDO_LIMIT
+#define UNDO_LIMIT (16 << 20)   // bytes of history kept; the oldest chunks go first
+#endif
+#define UNDO_CHUNK (64 * 1024)
+
+enum { UNDO_INSERT = 1, UNDO_DELETE };
+
+typedef struct undorec {
+    short type;
+    short newrow;       // the edit began by adding row 'row' past the end
+    int row, col;
+    int len;            // bytes of text after the header
+    int prev;           // offset of the record before it in the chunk, or -1
+    unsigned group;
+} undorec;
+
+typedef struct undochunk {
+    struct undochunk *prev, *next;
+    int size;           // as allocated from the arena, header included
+    int used;           // bytes of records in data
+    int last;           // offset of the last record, or -1
+    char data[];
+} undochunk;
+
+typedef struct undolog {
+    undochunk *first, *cur; // cur holds the position: what is applied ends there
+    int curoff;
+    unsigned group;         // newest group handed out
+    unsigned evicted;       // groups up to this one are (partly) gone
+    size_t bytes;           // held by chunks
+} undolog;
+
+/* The document is a rope of line chunks: a counted B+tree whose leaves hold
+ * up to DOC_LEAF_MAX rows and whose inner nodes keep the row count of every
+ * subtree. Lookup, insert and delete by line index are O(log n). With soft
+ * wrap every node also sums the screen lines its rows take, so the screen
+ * line of a row and the row at a screen line are O(log n) as well. Those
+ * sums are counted lazily: a change marks its path stale. */
+#define DOC_LEAF_MAX 64
+#define DOC_FANOUT 32
+
+typedef struct docnode {
+    int leaf;                       // 1: rows[], 0: child[]
+    int n;                          // rows or children in use
+    int count;                      // rows in this subtree
+    int stale;                      // lines needs recounting
+    long lines;                     // screen lines of the subtree (soft wrap)
+    struct docnode *prev, *next;    // neighbouring leaves, for sequential walks
+    union {
+        struct docnode *child[DOC_FANOUT];
+        erow rows[DOC_LEAF_MAX];
+    };
+} docnode;
+
+typedef struct document {
+    docnode *root;
+    docnode *hint;      // leaf of the last lookup; makes sequential access O(1)
+    int hint_start;     // line index of hint->rows[0]
+    char *map;          // read-only mapping of the opened file, or NULL
+    size_t maplen;
+    dev_t map_dev;      // identity of the mapped file
+    ino_t map_ino;
+    size_t disklen;     // length of the file when it last matched the rows
+    unsigned deletes;   // rows removed so far: a walk over the rows may have missed one
+    int loading;        // the mapping is still being split into rows
+    size_t load_off;    // how far the mapping has been scanned
+    size_t load_start;  // start of the line being scanned
+    arena mem;          // text of the rows that are not mapped
+    undolog undo;       // its chunks come from mem
+    int hl_valid;       // rows before this one have up-to-date lexer states
+    int hl_top;         // rows before this one were lexed at some point...
+    int hl_mark;        // ...and only those up to this one were edited since
+} document;
+
 struct editorConfig {
     int cx, cy;         // cursor x,y (in chars / rows)
+    int rx;             // screen column of the cursor (tabs, wide characters)
     int rowoff;         // row offset for vertical scrolling
     int coloff;         // col offset for horizontal scrolling
+    int wrap;           // soft wrap (Alt-S): long rows go on over several screen rows
+    int segoff;         // with wrap: which segment of row rowoff is at the top
+    int cseg;           // with wrap: the segment the cursor is on...
+    int wrapx, wrapy;   // ...the column it starts at, and the cursor's screen row
+    struct wrapline { int row, seg; } *layout, *drawn_layout; // with wrap: each screen row
     int screenrows;
-    int screencols;
+    int screencols;     // text columns: the terminal's, less the gutter
+    int termcols;
+    int lineno;         // line numbers on (Alt-N)
+    int gutter;         // columns they take, 0 when off
     int numrows;
-    erow *rows;
+    document doc;
+    struct editorSyntax *syntax;    // highlighting for the file type, or NULL
     int dirty;
     char filename[512];
     char statusmsg[80];
     time_t statusmsg_time;
+    int debug;          // show frame and allocator stats (Ctrl-D)
+    int frame_writes;   // write() syscalls used by the last frame
+    int frame_bytes;    // bytes sent by the last frame
+    unsigned char *damage;  // per screen row: needs repaint
+    int fullredraw;     // repaint every row on the next frame
+    int drawn_rowoff;   // rowoff/coloff the terminal currently shows
+    int drawn_coloff;
+    int drawn_empty;    // welcome screen is shown
+    int drawn_msg;      // the message bar shows statusmsg
+    int winchpipe[2];   // SIGWINCH self-pipe
+    long long resize_due;   // re-read the size then (monotonic ms; 0: no resize pending)
+    long long resize_by;    // ...but no later than this, however long the burst
+    int cpr_pending;    // the size was asked for with a cursor position report
+    int savepipe[2];    // written by the save thread when it finishes
+    long long input_at; // when input last arrived (monotonic ms), for idle work
+    int batch;          // --batch: no terminal, no swap files
+    int mouse;          // -m: ask the terminal for mouse reports
     struct termios orig_termios;
 } E;
 
+void editorRefreshScreen();
+void editorLoadSlice();
+void editorLoadAll();
+int editorSaveCollect(int wait);
+void editorFormatBytes(char *buf, size_t bufsz, size_t n);
+void editorSetSize(int rows, int cols);
+void editorToggleWrap();
+void followStart();
+void followStop();
+void followTick();
+char *editorReadPaste(int *len);
+
+enum editorKey {
+    KEY_NONE = -1,          // nothing to act on (unknown or cut-short sequence)
+    BACKSPACE = 127,
+    ARROW_UP = 'A' + 1000,
+    ARROW_DOWN = 'B' + 1000,
+    ARROW_RIGHT = 'C' + 1000,
+    ARROW_LEFT = 'D' + 1000,
+    DEL_KEY = 2000,
+    INSERT_KEY,
+    HOME_KEY,
+    END_KEY,
+    PAGE_UP,
+    PAGE_DOWN,
+    KEY_PASTE,              // start of a bracketed paste
+    MOUSE_EVENT,            // details in 'mouse'
+};
+
+// modifiers are or'ed into the key code
+#define KEY_SHIFT (1 << 16)
+#define KEY_ALT (1 << 17)
+#define KEY_CTRL (1 << 18)
+
+struct mouseEvent {
+    int button;             // 0-2 buttons, 64/65 wheel up/down
+    int x, y;               // 0-based screen cell
+    int release;
+} mouse;
+int editorResize();
+void editorClampCursor();
+void swapAppend(int type, int newrow, int row, int col, const char *s, int len);
+char *editorPrompt(const char *prompt, void (*callback)(char *, int));
+void editorApplyEdit(int type, int newrow, int row, int col, const char *s, int len);
+int swapTimeout();
+void swapTick();
+void hlInvalidate(int filerow, int delta);
+int hlPending();
+void hlSlice();
+int compactTimeout();
+void compactSlice();
+void compactAbort();
+long long monotonicMs();
+
+/* Instrumentation.
+ * Counters and histograms are atomics updated with relaxed ordering, so
+ * the save thread and the worker pool record without taking a lock. The
+ * histograms are log-linear, as in HdrHistogram: values below HIST_SUB get
+ * a bucket each, and every power of two above is split into HIST_SUB
+ * buckets, so a percentile is within 1/16 of the true value. Ctrl-D
+ * pressed twice shows the percentiles; with MINI_NANO_STATS=file set, a
+ * summary is appended to that file at exit. */
+#define HIST_SUB 16
+#define HIST_BUCKETS (37 * HIST_SUB) // values below 2^40
+
+struct histogram {
+    const char *name;
+    atomic_ulong n, sum, max;
+    atomic_ulong b[HIST_BUCKETS];
+};
+
+enum { ST_KEY, ST_DRAW, ST_BYTES, ST_WRITES, ST_NHIST };
+
+struct {
+    struct histogram h[ST_NHIST];
+    atomic_ulong allocs;    // arena allocations...
+    atomic_ulong mallocs;   // ...the ones that went to malloc
+    atomic_ulong frees;
+    atomic_ulong opens, open_bytes, open_us;
+    atomic_ulong saves, save_bytes, save_us;
+    long long key_at;       // when input arrived that no frame shows yet (us), or 0
+    long long open_at;      // when the file being loaded was opened (us)
+} stats = {.h = {{.name = "key_to_frame_us"}, {.name = "refresh_us"},
+                 {.name = "frame_bytes"}, {.name = "frame_writes"}}};
+
+long long monotonicUs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+void statAdd(atomic_ulong *c, unsigned long v) {
+    atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+int histBucket(unsigned long long v) {
+    if (v >= 1ULL << 40) v = (1ULL << 40) - 1;
+    if (v < HIST_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - 4; // keep the top five bits
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+// the largest value that falls in bucket i
+unsigned long long histBucketMax(int i) {
+    if (i < HIST_SUB) return i;
+    int shift = i / HIST_SUB - 1;
+    return ((unsigned long long)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+void histRecord(struct histogram *h, unsigned long v) {
+    statAdd(&h->b[histBucket(v)], 1);
+    statAdd(&h->n, 1);
+    statAdd(&h->sum, v);
+    unsigned long m = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (v > m && !atomic_compare_exchange_weak_explicit(&h->max, &m, v,
+                                                           memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/* The value below which a fraction q of the samples fall */
+unsigned long histPercentile(struct histogram *h, double q) {
+    unsigned long n = atomic_load_explicit(&h->n, memory_order_relaxed), seen = 0;
+    if (n == 0) return 0;
+    unsigned long rank = q * n + 0.5 > 1 ? (unsigned long)(q * n + 0.5) : 1;
+    unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->b[i], memory_order_relaxed);
+        if (seen >= rank) return histBucketMax(i) < max ? histBucketMax(i) : max;
+    }
+    return max;
+}
+
+/* A file is in: all of it split into rows */
+void statsOpened(size_t bytes) {
+    statAdd(&stats.opens, 1);
+    statAdd(&stats.open_bytes, bytes);
+    statAdd(&stats.open_us, monotonicUs() - stats.open_at);
+}
+
+// MB/s for bytes in us microseconds
+double statsRate(unsigned long bytes, unsigned long us) {
+    return us ? bytes / (double)us : 0;
+}
+
+void statsDump() {
+    const char *path = getenv("MINI_NANO_STATS");
+    FILE *fp = path && path[0] ? fopen(path, "a") : NULL;
+    if (!fp) return;
+    fprintf(fp, "# mini_nano session, pid %d, ended %ld\n", (int)getpid(), (long)time(NULL));
+    for (int i = 0; i < ST_NHIST; i++) {
+        struct histogram *h = &stats.h[i];
+        unsigned long n = atomic_load(&h->n);
+        fprintf(fp, "%-16s n=%lu mean=%.1f p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu\n", h->name, n,
+                n ? (double)atomic_load(&h->sum) / n : 0.0, histPercentile(h, 0.5), histPercentile(h, 0.9),
+                histPercentile(h, 0.99), histPercentile(h, 0.999), (unsigned long)atomic_load(&h->max));
+    }
+    fprintf(fp, "open             n=%lu bytes=%lu us=%lu MB/s=%.1f\n", (unsigned long)stats.opens,
+            (unsigned long)stats.open_bytes, (unsigned long)stats.open_us, statsRate(stats.open_bytes, stats.open_us));
+    fprintf(fp, "save             n=%lu bytes=%lu us=%lu MB/s=%.1f\n", (unsigned long)stats.saves,
+            (unsigned long)stats.save_bytes, (unsigned long)stats.save_us, statsRate(stats.save_bytes, stats.save_us));
+    fprintf(fp, "alloc            n=%lu malloc=%lu free=%lu\n", (unsigned long)stats.allocs,
+            (unsigned long)stats.mallocs, (unsigned long)stats.frees);
+    fclose(fp);
+}
+
 /* Terminal raw mode */
 void die(const char *s) {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    if (!E.batch) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+    }
     perror(s);
     exit(1);
 }
 
 void disableRawMode() {
+    if (E.mouse) write(STDOUT_FILENO, "\x1b[?1006l\x1b[?1000l", 16); // mouse reports off
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         ;
 }
@@ -69,68 +448,305 @@ void enableRawMode() {
     raw.c_oflag &= ~(OPOST);
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); // pastes arrive between \x1b[200~ and \x1b[201~
+    if (E.mouse) write(STDOUT_FILENO, "\x1b[?1000h\x1b[?1006h", 16); // clicks and the wheel, SGR encoded if supported
 }
 
-/* Utilities */
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+/* Keyboard input is read in large chunks into a ring buffer and decoded
+ * from there, so a paste or a key-repeat burst costs a few read() calls
+ * rather than one per byte. */
+#define INBUF_SIZE 65536
+
+struct inbuf {
+    char buf[INBUF_SIZE];
+    unsigned head, tail;    // free-running; tail - head bytes are queued
+} in;
+
+/* Read what stdin has (it must be readable). Returns -1 on EOF or error. */
+int inFill() {
+    unsigned used = in.tail - in.head;
+    if (used == INBUF_SIZE) return 0;
+    unsigned at = in.tail % INBUF_SIZE;
+    unsigned room = INBUF_SIZE - at; // contiguous space after the tail
+    if (room > INBUF_SIZE - used) room = INBUF_SIZE - used;
+    ssize_t n = read(STDIN_FILENO, in.buf + at, room);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (n <= 0) return -1;
+    in.tail += n;
+    if (!stats.key_at) stats.key_at = monotonicUs();
+    E.input_at = monotonicMs();
+    return n;
+}
+
+int inPop(char *c) {
+    if (in.head == in.tail) return 0;
+    *c = in.buf[in.head++ % INBUF_SIZE];
+    return 1;
+}
+
+/* Is there a key to process (already buffered or waiting on stdin)? */
+int editorInputPending() {
+    if (in.head != in.tail) return 1;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, 0) > 0 && inFill() == -1) die("read");
+    return in.head != in.tail;
+}
+
+/* Event loop.
+ * editorReadKey sleeps in poll() until a key arrives, the window is resized
+ * (SIGWINCH through a self-pipe), a background save finishes (its pipe), a
+ * followed file changes (inotify) or the status message is due to expire.
+ * An idle editor never wakes up.
+ * A resize is acted on once the signals have stopped for RESIZE_DELAY ms
+ * (at most RESIZE_MAX ms after the first), so dragging a pane edge reflows
+ * a few times rather than once per signal. */
+#define RESIZE_DELAY 30
+#define RESIZE_MAX 100
+
+/* Follow mode: bytes appended to the file are read FOLLOW_DELAY ms after
+ * the change is seen, so the rest of a burst comes along, and at most once
+ * every FOLLOW_INTERVAL ms and FOLLOW_SLICE bytes at a time, so a fast log
+ * costs a frame per interval and a bounded share of a core. Without inotify
+ * the file is polled every FOLLOW_POLL ms. */
+#define FOLLOW_DELAY 10
+#define FOLLOW_INTERVAL 50
+#define FOLLOW_POLL 250
+#define FOLLOW_SLICE (4 << 20)
+
+struct {
+    int on;
+    int fd;             // the file, open for reading
+    int ifd;            // inotify descriptor, -1 when polling
+    dev_t dev;          // identity of the file, to notice it being replaced
+    ino_t ino;
+    size_t off;         // how much of it is in the document
+    int partial;        // the last row is a line still waiting for its '\n'
+    long long due;      // when to read it next, 0 if nothing is pending
+    long long last;     // when it was last read
+} follow = {.fd = -1, .ifd = -1};
+
+void makePipe(int fds[2]) {
+    if (pipe(fds) == -1) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
     }
+}
 
-    if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+void drainPipe(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
 
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '3': return 127; // DEL
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return 'A' + 1000; // up
-                    case 'B': return 'B' + 1000; // down
-                    case 'C': return 'C' + 1000; // right
-                    case 'D': return 'D' + 1000; // left
-                }
-            }
-        }
+long long monotonicMs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+void handleSigwinch(int sig) {
+    (void)sig;
+    int saved = errno;
+    if (write(E.winchpipe[1], "", 1) == -1) {} // full pipe: a wakeup is pending anyway
+    errno = saved;
+}
 
-        return '\x1b';
+/* Milliseconds until something needs doing without input (a redraw or a
+ * journal flush), or -1 */
+int editorTimeout() {
+    if (E.doc.loading || hlPending()) return 0;
+    int t = swapTimeout();
+    int c = compactTimeout();
+    if (c != -1 && (t == -1 || c < t)) t = c;
+    if (E.resize_due) {
+        long long ms = E.resize_due - monotonicMs();
+        if (ms < 0) ms = 0;
+        if (t == -1 || ms < t) t = ms;
+    }
+    if (follow.due) {
+        long long ms = follow.due - monotonicMs();
+        if (ms < 0) ms = 0;
+        if (t == -1 || ms < t) t = ms;
     }
+    if (E.drawn_msg) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        long long ms = (long long)(E.statusmsg_time + 5) * 1000 - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+        if (ms < 0) ms = 0;
+        if (t == -1 || ms < t) t = ms;
+    }
+    return t;
+}
 
-    return c;
+/* Read one byte, waiting at most 'timeout' ms. Returns 1 if one was read. */
+int editorReadByte(char *c, int timeout) {
+    if (inPop(c)) return 1;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) <= 0) return 0;
+    if (inFill() == -1) die("read");
+    return inPop(c);
 }
 
-int getCursorPosition(int *rows, int *cols) {
-    char buf[32];
-    unsigned int i = 0;
+/* Escape sequences.
+ * The decoder reads from the input buffer, so a whole sequence usually
+ * costs no extra syscall. CSI parameters are collected byte by byte
+ * (ECMA-48: parameters 0x30-0x3f, intermediates 0x20-0x2f, final
+ * 0x40-0x7e) and the final byte and first parameter are looked up in
+ * keyseqs. A sequence that stops arriving for ESC_TIMEOUT ms is dropped;
+ * a lone ESC is the Escape key. */
+#define ESC_TIMEOUT 50
+#define CSI_MAXPARAMS 8
 
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+struct keyseq {
+    char final;
+    int num;                // first parameter, only for '~' sequences
+    int key;
+};
 
-    while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-        if (buf[i] == 'R') break;
-        i++;
+static const struct keyseq keyseqs[] = {
+    {'A', 0, ARROW_UP}, {'B', 0, ARROW_DOWN}, {'C', 0, ARROW_RIGHT}, {'D', 0, ARROW_LEFT},
+    {'H', 0, HOME_KEY}, {'F', 0, END_KEY},
+    {'~', 1, HOME_KEY}, {'~', 2, INSERT_KEY}, {'~', 3, DEL_KEY}, {'~', 4, END_KEY},
+    {'~', 5, PAGE_UP}, {'~', 6, PAGE_DOWN}, {'~', 7, HOME_KEY}, {'~', 8, END_KEY},
+    {'~', 200, KEY_PASTE},
+};
+
+int keyLookup(char final, int num) {
+    if (final != '~') num = 0;
+    for (size_t i = 0; i < sizeof(keyseqs) / sizeof(keyseqs[0]); i++)
+        if (keyseqs[i].final == final && keyseqs[i].num == num) return keyseqs[i].key;
+    return KEY_NONE;
+}
+
+/* xterm encodes modifiers as 1 + (shift | alt << 1 | ctrl << 2) */
+int keyModifiers(int param) {
+    int m = param > 1 ? param - 1 : 0, mods = 0;
+    if (m & 1) mods |= KEY_SHIFT;
+    if (m & 2) mods |= KEY_ALT;
+    if (m & 4) mods |= KEY_CTRL;
+    return mods;
+}
+
+/* Decode what follows an ESC */
+int editorDecodeEscape() {
+    char c;
+    if (!editorReadByte(&c, ESC_TIMEOUT)) return '\x1b';
+    if (c == 'O') { // SS3: keypad-mode arrows, Home/End
+        if (!editorReadByte(&c, ESC_TIMEOUT)) return KEY_NONE;
+        return keyLookup(c, 0);
     }
-    buf[i] = '\0';
+    if (c != '[') return (unsigned char)c | KEY_ALT;
 
-    if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-    if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+    int params[CSI_MAXPARAMS] = {0};
+    int np = 0;
+    char priv = 0;
+    while (1) {
+        if (!editorReadByte(&c, ESC_TIMEOUT)) return KEY_NONE;
+        if (c >= '0' && c <= '9') {
+            if (np == 0) np = 1;
+            if (params[np - 1] < 100000) params[np - 1] = params[np - 1] * 10 + (c - '0');
+        } else if (c == ';' || c == ':') {
+            if (np == 0) np = 1;
+            if (np < CSI_MAXPARAMS) np++;
+        } else if (c >= 0x3c && c <= 0x3f) {
+            priv = c;
+        } else if (c >= 0x40 && c <= 0x7e) {
+            break;
+        } else if (c < 0x20 || c > 0x2f) {
+            return KEY_NONE; // not part of a CSI sequence
+        }
+    }
 
-    return 0;
+    if (c == 'M' && np == 0 && !priv) {
+        // X10 mouse: three bytes, each offset by 32
+        char b[3];
+        for (int i = 0; i < 3; i++)
+            if (!editorReadByte(&b[i], ESC_TIMEOUT)) return KEY_NONE;
+        mouse.button = ((unsigned char)b[0] - 32) & ~(4 | 8 | 16);
+        mouse.release = mouse.button == 3;
+        mouse.x = (unsigned char)b[1] - 33;
+        mouse.y = (unsigned char)b[2] - 33;
+        return MOUSE_EVENT;
+    }
+    if (priv == '<' && (c == 'M' || c == 'm') && np >= 3) {
+        // SGR mouse: button;x;y, 'm' on release
+        mouse.button = params[0] & ~(4 | 8 | 16);
+        mouse.x = params[1] - 1;
+        mouse.y = params[2] - 1;
+        mouse.release = c == 'm';
+        return MOUSE_EVENT;
+    }
+    if (c == 'R' && np == 2 && !priv && E.cpr_pending) {
+        // the answer to the size query: the cursor was sent to the far corner
+        E.cpr_pending = 0;
+        editorSetSize(params[0], params[1]);
+        return KEY_NONE;
+    }
+    if (priv) return KEY_NONE;
+
+    int key = keyLookup(c, params[0]);
+    if (key == KEY_NONE) return KEY_NONE;
+    return key | (np >= 2 ? keyModifiers(params[1]) : 0);
+}
+
+int editorReadKey() {
+    char c;
+    while (!inPop(&c)) {
+        struct pollfd fds[4] = {
+            {STDIN_FILENO, POLLIN, 0},
+            {E.winchpipe[0], POLLIN, 0},
+            {E.savepipe[0], POLLIN, 0},
+            {follow.ifd, POLLIN, 0}, // ignored while it is -1
+        };
+        if (poll(fds, 4, editorTimeout()) == -1) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+        swapTick();
+        if (fds[0].revents) {
+            if (inFill() == -1) die("read");
+            continue;
+        }
+        if (fds[1].revents) {
+            drainPipe(E.winchpipe[0]);
+            long long now = monotonicMs();
+            if (!E.resize_due) E.resize_by = now + RESIZE_MAX;
+            E.resize_due = now + RESIZE_DELAY < E.resize_by ? now + RESIZE_DELAY : E.resize_by;
+        }
+        if (E.resize_due && monotonicMs() >= E.resize_due) editorResize();
+        if (fds[2].revents) {
+            drainPipe(E.savepipe[0]);
+            editorSaveCollect(0);
+        }
+        if (fds[3].revents) {
+            drainPipe(follow.ifd);
+            if (!follow.due) {
+                long long now = monotonicMs();
+                follow.due = now + FOLLOW_DELAY > follow.last + FOLLOW_INTERVAL ?
+                             now + FOLLOW_DELAY : follow.last + FOLLOW_INTERVAL;
+            }
+        }
+        if (follow.due && monotonicMs() >= follow.due) followTick();
+        // keep indexing a file that is still loading until a key arrives,
+        // then lex what is not on screen, then tidy up memory
+        if (E.doc.loading) editorLoadSlice();
+        else if (hlPending()) hlSlice();
+        else if (compactTimeout() == 0) compactSlice();
+        if (!E.resize_due) editorRefreshScreen(); // not at a size that is about to change
+    }
+
+    return c == '\x1b' ? editorDecodeEscape() : (unsigned char)c;
 }
 
+/* Get the terminal size. Without TIOCGWINSZ the cursor is sent to the far
+ * corner and its position asked for; that answer arrives later with the
+ * keys (see editorDecodeEscape), so this returns 1 and leaves the size
+ * alone. Returns 0 when the size is known, -1 on error. */
 int getWindowSize(int *rows, int *cols) {
 #ifdef _WIN32
     CONSOLE_SCREEN_BUFFER_INFO csbi;
@@ -144,8 +760,10 @@ int getWindowSize(int *rows, int *cols) {
     struct winsize ws;
 
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-        return getCursorPosition(rows, cols);
+        // save the cursor, query from the corner, put it back
+        if (write(STDOUT_FILENO, "\x1b" "7\x1b[999C\x1b[999B\x1b[6n\x1b" "8", 18) != 18) return -1;
+        E.cpr_pending = 1;
+        return 1;
     } else {
         *cols = ws.ws_col;
         *rows = ws.ws_row;
@@ -154,302 +772,4630 @@ int getWindowSize(int *rows, int *cols) {
 #endif
 }
 
-/* Row operations */
-void editorAppendRow(char *s, size_t len) {
-    E.rows = realloc(E.rows, sizeof(erow) * (E.numrows + 1));
-    int at = E.numrows;
-    E.rows[at].size = len;
-    E.rows[at].chars = malloc(len + 1);
-    memcpy(E.rows[at].chars, s, len);
-    E.rows[at].chars[len] = '\0';
-    E.numrows++;
-    E.dirty = 1;
+/* Append buffer: a whole frame is collected here and sent in one write() */
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+void abGrow(struct abuf *ab, int need) {
+    if (ab->len + need <= ab->cap) return;
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + need) cap *= 2;
+    char *nb = realloc(ab->b, cap);
+    if (nb == NULL) die("realloc");
+    ab->b = nb;
+    ab->cap = cap;
 }
 
-void editorFreeRows() {
-    for (int i = 0; i < E.numrows; i++) free(E.rows[i].chars);
-    free(E.rows);
-    E.rows = NULL;
-    E.numrows = 0;
+void abAppend(struct abuf *ab, const char *s, int len) {
+    abGrow(ab, len);
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
 }
 
-/* File I/O */
-void editorOpen(const char *filename) {
-    editorFreeRows();
-    strncpy(E.filename, filename, sizeof(E.filename)-1);
-    E.filename[sizeof(E.filename)-1] = '\0';
+/* Append n copies of c (padding) */
+void abAppendFill(struct abuf *ab, char c, int n) {
+    if (n <= 0) return;
+    abGrow(ab, n);
+    memset(&ab->b[ab->len], c, n);
+    ab->len += n;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        snprintf(E.statusmsg, sizeof(E.statusmsg), "Could not open: %s", strerror(errno));
-        E.statusmsg_time = time(NULL);
-        return;
-    }
+void abFree(struct abuf *ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
 
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t len;
-    while ((len = getline(&line, &cap, fp)) != -1) {
-        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) len--;
-        editorAppendRow(line, len);
+/* Send the frame, retrying on short writes; returns the number of write() calls */
+int abFlush(struct abuf *ab) {
+    int calls = 0;
+    int off = 0;
+    while (off < ab->len) {
+        ssize_t n = write(STDOUT_FILENO, ab->b + off, ab->len - off);
+        calls++;
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            break;
+        }
+        off += n;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
-    snprintf(E.statusmsg, sizeof(E.statusmsg), "Opened %s", filename);
-    E.statusmsg_time = time(NULL);
+    return calls;
 }
 
-int editorSave(const char *filename) {
-    char tmp[1024];
-    if (filename == NULL || filename[0] == '\0') filename = E.filename[0] ? E.filename : NULL;
-    if (!filename) {
-        snprintf(E.statusmsg, sizeof(E.statusmsg), "No filename");
-        E.statusmsg_time = time(NULL);
-        return 0;
-    }
+/* Screen damage tracking.
+ * Edits mark the screen rows they touch; line insert/delete and vertical
+ * scrolling move what is already on the terminal with a scroll region
+ * instead of repainting it. Screen rows are relative to drawn_rowoff, i.e.
+ * to what the terminal shows right now. Scroll commands are queued here and
+ * sent at the start of the next frame. */
+struct abuf scrollops = ABUF_INIT;
 
-    int fd = open(filename, O_RDWR | O_CREAT, 0644);
-    if (fd == -1) {
-        snprintf(E.statusmsg, sizeof(E.statusmsg), "Can't save: %s", strerror(errno));
-        E.statusmsg_time = time(NULL);
-        return 0;
+void editorInvalidateScreen() {
+    E.fullredraw = 1;
+    scrollops.len = 0;
+}
+
+/* Repaint a row on the next frame */
+void editorDamageRow(int filerow) {
+    if (E.fullredraw) return;
+    if (E.wrap) {
+        for (int y = 0; y < E.screenrows; y++)
+            if (E.drawn_layout[y].row == filerow) E.damage[y] = 1;
+        return;
     }
+    int y = filerow - E.drawn_rowoff;
+    if (y < 0 || y >= E.screenrows) return;
+    E.damage[y] = 1;
+}
 
-    // Build buffer
-    size_t totlen = 0;
-    for (int i = 0; i < E.numrows; i++) totlen += E.rows[i].size + 1; // add newline
+/* With wrap, rows from filerow on moved: repaint every screen row showing one */
+void editorDamageFrom(int filerow) {
+    if (E.fullredraw) return;
+    for (int y = 0; y < E.screenrows; y++)
+        if (E.drawn_layout[y].row >= filerow) E.damage[y] = 1;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (int i = 0; i < E.numrows; i++) {
-        memcpy(p, E.rows[i].chars, E.rows[i].size);
-        p += E.rows[i].size;
-        *p = '\n';
-        p++;
-    }
+void docTouch(document *d, int at);
 
-    // write
-    if (ftruncate(fd, 0) == -1) { close(fd); free(buf); return 0; }
-    if (write(fd, buf, totlen) != (ssize_t)totlen) {
-        snprintf(E.statusmsg, sizeof(E.statusmsg), "Write error: %s", strerror(errno));
-        E.statusmsg_time = time(NULL);
-        close(fd);
-        free(buf);
-        return 0;
-    }
-    close(fd);
-    free(buf);
-    E.dirty = 0;
-    snprintf(E.statusmsg, sizeof(E.statusmsg), "Saved to %s", filename);
-    E.statusmsg_time = time(NULL);
-    return 1;
+/* The text of a row changed */
+void editorMarkRowDirty(int filerow) {
+    hlInvalidate(filerow, 0);
+    if (E.wrap) docTouch(&E.doc, filerow);
+    editorDamageRow(filerow);
 }
 
-/* Editor operations: insertion, deletion, newline */
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        // append empty row
-        editorAppendRow("", 0);
+/* Scroll screen rows top..bottom by n lines: n > 0 moves content up (SU),
+ * n < 0 down (SD). Lines that scroll in are marked for repaint. */
+void editorScrollRegion(int top, int bottom, int n) {
+    if (E.fullredraw || n == 0) return;
+    int height = bottom - top + 1;
+    int an = n > 0 ? n : -n;
+    if (an >= height || height < 2 || scrollops.len > E.screenrows * 16) {
+        // scrolling buys nothing here (or too many queued): repaint instead
+        if (height >= E.screenrows || scrollops.len > E.screenrows * 16) {
+            editorInvalidateScreen();
+            return;
+        }
+        memset(&E.damage[top], 1, height);
+        return;
     }
-    erow *row = &E.rows[E.cy];
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[E.cx + 1], &row->chars[E.cx], row->size - E.cx + 1);
-    row->size++;
-    row->chars[E.cx] = c;
-    E.cx++;
-    E.dirty = 1;
-}
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
-    erow *row = &E.rows[E.cy];
-    if (E.cx > 0) {
-        memmove(&row->chars[E.cx - 1], &row->chars[E.cx], row->size - E.cx + 1);
-        row->size--;
-        E.cx--;
-        E.dirty = 1;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c", top + 1, bottom + 1, an, n > 0 ? 'S' : 'T');
+    abAppend(&scrollops, buf, len);
+
+    if (n > 0) {
+        memmove(&E.damage[top], &E.damage[top + an], height - an);
+        memset(&E.damage[bottom - an + 1], 1, an);
     } else {
-        // join line with previous
-        int prev_size = E.rows[E.cy - 1].size;
-        E.rows[E.cy - 1].chars = realloc(E.rows[E.cy - 1].chars, prev_size + row->size + 1);
-        memcpy(&E.rows[E.cy - 1].chars[prev_size], row->chars, row->size);
-        E.rows[E.cy - 1].size = prev_size + row->size;
-        E.rows[E.cy - 1].chars[E.rows[E.cy - 1].size] = '\0';
-        free(row->chars);
-        // shift rows up
-        for (int i = E.cy; i < E.numrows - 1; i++) E.rows[i] = E.rows[i + 1];
-        E.numrows--;
-        E.cy--;
-        E.cx = prev_size;
-        E.dirty = 1;
+        memmove(&E.damage[top + an], &E.damage[top], height - an);
+        memset(&E.damage[top], 1, an);
     }
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorAppendRow("", 0);
-        // shift rows down
-        for (int i = E.numrows - 1; i > E.cy; i--) E.rows[i] = E.rows[i - 1];
-        E.rows[E.cy + 1].chars = strdup(E.rows[E.cy].chars);
-        E.rows[E.cy + 1].size = E.rows[E.cy].size;
-        E.rows[E.cy].size = 0;
-        free(E.rows[E.cy].chars);
-        E.rows[E.cy].chars = strdup("");
-    } else {
-        erow *row = &E.rows[E.cy];
-        char *newchars = malloc(row->size - E.cx + 1);
-        int newlen = row->size - E.cx;
-        memcpy(newchars, &row->chars[E.cx], newlen);
-        newchars[newlen] = '\0';
-
-        row->chars = realloc(row->chars, E.cx + 1);
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-
-        // insert new row after current
-        editorAppendRow(newchars, newlen);
-        // shift appended row to correct position
-        for (int i = E.numrows - 1; i > E.cy + 1; i--) E.rows[i] = E.rows[i - 1];
-        E.rows[E.cy + 1].chars = newchars;
-        E.rows[E.cy + 1].size = newlen;
-    }
-    E.cy++;
-    E.cx = 0;
-    E.dirty = 1;
+/* The rows from screen row y down now show other line numbers: the scroll
+ * region would move their text but keep the numbers, so repaint them */
+void editorDamageBelow(int y) {
+    if (E.fullredraw) return;
+    memset(&E.damage[y], 1, E.screenrows - y);
 }
 
-/* Input prompt (status line) */
-char *editorPrompt(const char *prompt) {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
-    size_t buflen = 0;
+/* A row was inserted at filerow: it and everything below move down a line */
+void editorScreenInsertRow(int filerow) {
+    hlInvalidate(filerow, 1);
+    if (E.wrap) { editorDamageFrom(filerow); return; }
+    int y = filerow - E.drawn_rowoff;
+    if (y >= E.screenrows) return;
+    if (y < 0) y = 0;
+    if (E.gutter) { editorDamageBelow(y); return; }
+    editorScrollRegion(y, E.screenrows - 1, -1);
+    editorMarkRowDirty(filerow);
+}
 
-    while (1) {
-        snprintf(E.statusmsg, sizeof(E.statusmsg), "%s%s", prompt, buf);
-        E.statusmsg_time = time(NULL);
-        // refresh
-        // draw
-        // simple refresh partial
-        write(STDOUT_FILENO, "\x1b[2K\r", 4);
-        write(STDOUT_FILENO, E.statusmsg, strlen(E.statusmsg));
+/* The row at filerow was removed: everything below moves up a line */
+void editorScreenDeleteRow(int filerow) {
+    hlInvalidate(filerow, -1);
+    if (E.wrap) { editorDamageFrom(filerow); return; }
+    int y = filerow - E.drawn_rowoff;
+    if (y >= E.screenrows) return;
+    if (y < 0) y = 0;
+    if (E.gutter) { editorDamageBelow(y); return; }
+    editorScrollRegion(y, E.screenrows - 1, 1);
+}
 
-        int c = editorReadKey();
-        if (c == '\r') {
-            if (buflen != 0) return buf;
-            else { free(buf); return NULL; }
-        } else if (c == 127 || c == 8) {
-            if (buflen != 0) buf[--buflen] = '\0';
-        } else if (!iscntrl(c) && c < 128) {
-            if (buflen + 1 >= bufsize) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
-            }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
-        } else if (c == '\x1b') {
-            free(buf);
-            return NULL;
+/* Row arena */
+int arenaClass(int size) {
+    int c = 0;
+    while ((1 << (ARENA_MIN_SHIFT + c)) < size) c++;
+    return c;
+}
+
+/* Allocate at least 'size' bytes; *cap receives the usable size */
+void *arenaAlloc(arena *a, int size, int *cap) {
+    statAdd(&stats.allocs, 1);
+    if (size > ARENA_SMALL_MAX) {
+        statAdd(&stats.mallocs, 1);
+        arenabig *b = malloc(sizeof(arenabig) + size);
+        if (b == NULL) die("malloc");
+        b->size = size;
+        b->prev = NULL;
+        b->next = a->big;
+        if (a->big) a->big->prev = b;
+        a->big = b;
+        a->nbig++;
+        a->used += size;
+        a->reserved += sizeof(arenabig) + size;
+        *cap = size;
+        return b + 1;
+    }
+    int c = arenaClass(size);
+    int csize = 1 << (ARENA_MIN_SHIFT + c);
+    void *p = a->freelist[c];
+    if (p) {
+        a->freelist[c] = *(void **)p;
+    } else {
+        if (a->blocks == NULL || a->blocks->used + csize > ARENA_BLOCK) {
+            statAdd(&stats.mallocs, 1);
+            arenablock *blk = malloc(sizeof(arenablock) + ARENA_BLOCK);
+            if (blk == NULL) die("malloc");
+            blk->used = 0;
+            blk->next = a->blocks;
+            a->blocks = blk;
+            a->reserved += sizeof(arenablock) + ARENA_BLOCK;
         }
+        p = a->blocks->data + a->blocks->used;
+        a->blocks->used += csize;
     }
+    a->used += csize;
+    *cap = csize;
+    return p;
 }
 
-/* Output rendering */
-void editorScroll() {
-    if (E.cy < E.rowoff) E.rowoff = E.cy;
-    if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
-    if (E.cx < E.coloff) E.coloff = E.cx;
-    if (E.cx >= E.coloff + E.screencols) E.coloff = E.cx - E.screencols + 1;
+/* Is p in one of the blocks the compactor is emptying? */
+int arenaVictim(arena *a, const void *p) {
+    int lo = 0, hi = a->nvictims;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((const char *)p < a->victims[mid]) hi = mid;
+        else if ((const char *)p >= a->victims[mid] + ARENA_BLOCK) lo = mid + 1;
+        else return 1;
+    }
+    return 0;
 }
 
-void editorDrawRows() {
-    for (int y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows/3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome), "mini_nano -- simple editor");
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    write(STDOUT_FILENO, "~", 1);
-                    padding--;
-                }
-                for (; padding > 0; padding--) write(STDOUT_FILENO, " ", 1);
-                write(STDOUT_FILENO, welcome, welcomelen);
-            } else {
-                write(STDOUT_FILENO, "~", 1);
-            }
-        } else {
-            int len = E.rows[filerow].size - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screencols) len = E.screencols;
-            write(STDOUT_FILENO, &E.rows[filerow].chars[E.coloff], len);
+/* Return a buffer of capacity 'cap' (as reported by arenaAlloc) */
+void arenaFree(arena *a, void *p, int cap) {
+    if (p == NULL) return;
+    statAdd(&stats.frees, 1);
+    if (a->pinned) {
+        if (a->ndeferred == a->deferredcap) {
+            a->deferredcap = a->deferredcap ? a->deferredcap * 2 : 256;
+            a->deferred = realloc(a->deferred, sizeof(struct arenaptr) * a->deferredcap);
+            if (a->deferred == NULL) die("realloc");
         }
-        write(STDOUT_FILENO, "\x1b[K", 3);
-        if (y < E.screenrows - 1) write(STDOUT_FILENO, "\r\n", 2);
+        a->deferred[a->ndeferred].p = p;
+        a->deferred[a->ndeferred].cap = cap;
+        a->ndeferred++;
+        return;
+    }
+    a->used -= cap;
+    a->churn += cap;
+    if (cap > ARENA_SMALL_MAX) {
+        arenabig *b = (arenabig *)p - 1;
+        if (b->prev) b->prev->next = b->next;
+        else a->big = b->next;
+        if (b->next) b->next->prev = b->prev;
+        a->nbig--;
+        a->reserved -= sizeof(arenabig) + b->size;
+        free(b);
+        return;
     }
+    if (a->nvictims && arenaVictim(a, p)) return; // its block is being emptied
+    int c = arenaClass(cap);
+    *(void **)p = a->freelist[c];
+    a->freelist[c] = p;
 }
 
-void editorRefreshScreen() {
-    editorScroll();
-
-    char buf[32];
-    write(STDOUT_FILENO, "\x1b[?25l", 6); // hide cursor
-    write(STDOUT_FILENO, "\x1b[H", 3);
+/* Grow a buffer to at least 'size' bytes, keeping its contents */
+void *arenaRealloc(arena *a, void *p, int oldcap, int size, int *cap) {
+    if (p && oldcap > ARENA_SMALL_MAX && !a->pinned) {
+        // big buffers stay big: let realloc move them and fix the links
+        arenabig *b = realloc((arenabig *)p - 1, sizeof(arenabig) + size);
+        if (b == NULL) die("realloc");
+        if (b->prev) b->prev->next = b;
+        else a->big = b;
+        if (b->next) b->next->prev = b;
+        a->used += size - b->size;
+        a->reserved += size - b->size;
+        b->size = size;
+        *cap = size;
+        return b + 1;
+    }
+    void *np = arenaAlloc(a, size, cap);
+    if (p) {
+        memcpy(np, p, oldcap);
+        arenaFree(a, p, oldcap);
+    }
+    return np;
+}
 
-    editorDrawRows();
+/* The save is done: free what was held back */
+void arenaUnpin(arena *a) {
+    a->pinned = 0;
+    for (int i = 0; i < a->ndeferred; i++) arenaFree(a, a->deferred[i].p, a->deferred[i].cap);
+    a->ndeferred = 0;
+}
 
-    // status bar
-    write(STDOUT_FILENO, "\x1b[7m", 4); // invert colors
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s %s", E.filename[0] ? E.filename : "[No Name]", E.dirty ? " (modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d lines", E.numrows);
-    if (len > E.screencols) len = E.screencols;
-    write(STDOUT_FILENO, status, len);
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            write(STDOUT_FILENO, rstatus, rlen);
-            break;
-        } else {
-            write(STDOUT_FILENO, " ", 1);
-            len++;
-        }
+/* Free everything the arena holds at once */
+void arenaRelease(arena *a) {
+    free(a->deferred);
+    free(a->victims);
+    while (a->blocks) {
+        arenablock *blk = a->blocks;
+        a->blocks = blk->next;
+        free(blk);
     }
-    write(STDOUT_FILENO, "\x1b[m", 3);
-    write(STDOUT_FILENO, "\r\n", 2);
-
-    // status message
-    if (time(NULL) - E.statusmsg_time < 5) {
-        write(STDOUT_FILENO, E.statusmsg, strlen(E.statusmsg));
+    while (a->big) {
+        arenabig *b = a->big;
+        a->big = b->next;
+        free(b);
     }
+    memset(a, 0, sizeof(*a));
+}
 
-    // position cursor
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.cx - E.coloff) + 1);
-    write(STDOUT_FILENO, buf, strlen(buf));
-    write(STDOUT_FILENO, "\x1b[?25h", 6); // show cursor
+/* Gap buffer primitives */
+#define ROW_MIN_CAP 16
+
+/* Second half of the row text */
+char *rowTail(erow *row) {
+    return row->chars + row->gap + (row->cap - row->size);
 }
 
-/* Input handling */
-void editorMoveCursor(int key) {
-    switch (key) {
-        case 'A' + 1000: // up
-            if (E.cy > 0) E.cy--;
-            if (E.cy < E.numrows && E.cx > E.rows[E.cy].size) E.cx = E.rows[E.cy].size;
-            break;
-        case 'B' + 1000: // down
-            if (E.cy < E.numrows) E.cy++;
-            if (E.cy < E.numrows && E.cx > E.rows[E.cy].size) E.cx = E.rows[E.cy].size;
+/* Give a mapped row its own buffer with room for 'extra' more characters */
+void rowUnmap(arena *a, erow *row, int extra) {
+    int cap;
+    char *nc = arenaAlloc(a, row->size + (extra > ROW_MIN_CAP ? extra : ROW_MIN_CAP), &cap);
+    memcpy(nc, row->chars, row->size);
+    row->chars = nc;
+    row->cap = cap;
+    row->gap = row->size;
+    row->flags &= ~ROW_MAPPED;
+}
+
+/* Called before changing a row's buffer: if a save may be reading it, give
+ * the row a copy to edit instead */
+void rowOwn(arena *a, erow *row) {
+    if (!(row->flags & ROW_SHARED)) return;
+    row->flags &= ~ROW_SHARED;
+    if (!a->pinned) return;
+    int cap;
+    char *nc = arenaAlloc(a, row->cap, &cap);
+    memcpy(nc, row->chars, row->cap);
+    arenaFree(a, row->chars, row->cap);
+    row->chars = nc;
+}
+
+/* Move the gap so it starts at 'at' */
+void rowMoveGap(arena *a, erow *row, int at) {
+    if (row->flags & ROW_MAPPED) rowUnmap(a, row, 0);
+    rowOwn(a, row);
+    if (at == row->gap) return;
+    int gaplen = row->cap - row->size;
+    if (at < row->gap)
+        memmove(row->chars + at + gaplen, row->chars + at, row->gap - at);
+    else
+        memmove(row->chars + row->gap, row->chars + row->gap + gaplen, at - row->gap);
+    row->gap = at;
+}
+
+/* Make room for at least n more characters, growing capacity geometrically */
+void rowReserve(arena *a, erow *row, int n) {
+    if (row->flags & ROW_MAPPED) rowUnmap(a, row, n);
+    rowOwn(a, row);
+    if (row->cap - row->size >= n) return;
+    int want = row->cap ? row->cap : ROW_MIN_CAP;
+    while (want - row->size < n) want *= 2;
+    int taillen = row->size - row->gap;
+    int cap;
+    char *nc = arenaRealloc(a, row->chars, row->cap, want, &cap);
+    memmove(nc + cap - taillen, nc + row->cap - taillen, taillen);
+    row->chars = nc;
+    row->cap = cap;
+}
+
+int textPlain(const char *s, size_t len);
+
+/* The text is about to change: drop what was derived from it */
+void rowChanged(arena *a, erow *row) {
+    row->flags &= ~(ROW_PLAIN | ROW_HLOK);
+    if (row->render) arenaFree(a, row->render, row->render->cap);
+    row->render = NULL;
+}
+
+void rowInsert(arena *a, erow *row, int at, const char *s, int len) {
+    int plain = (row->flags & ROW_PLAIN) && textPlain(s, len);
+    rowChanged(a, row);
+    if (plain) row->flags |= ROW_PLAIN; // typing ASCII does not rescan the row
+    rowReserve(a, row, len);
+    rowMoveGap(a, row, at);
+    memcpy(row->chars + row->gap, s, len);
+    row->gap += len;
+    row->size += len;
+}
+
+/* Delete len characters starting at 'at' */
+void rowDelete(arena *a, erow *row, int at, int len) {
+    int plain = row->flags & ROW_PLAIN;
+    rowChanged(a, row);
+    row->flags |= plain;
+    if (row->flags & ROW_MAPPED) {
+        // cutting a prefix or suffix keeps the row in the mapping
+        if (at + len == row->size) {
+            row->size = row->cap = row->gap = at;
+            return;
+        }
+        if (at == 0) {
+            row->chars += len;
+            row->size = row->cap = row->gap = row->size - len;
+            return;
+        }
+    }
+    rowMoveGap(a, row, at);
+    row->size -= len;
+}
+
+/* Character i of the row */
+char rowAt(erow *row, int i) {
+    return i < row->gap ? row->chars[i] : rowTail(row)[i - row->gap];
+}
+
+/* Copy len characters starting at 'at' into dst, reading across the gap */
+void rowCopy(erow *row, int at, int len, char *dst) {
+    if (at < row->gap) {
+        int n = row->gap - at < len ? row->gap - at : len;
+        memcpy(dst, row->chars + at, n);
+        dst += n; at += n; len -= n;
+    }
+    if (len > 0) memcpy(dst, rowTail(row) + (at - row->gap), len);
+}
+
+/* Append len characters of the row starting at 'at' to an append buffer */
+void rowAppendTo(struct abuf *ab, erow *row, int at, int len) {
+    if (at < row->gap) {
+        int n = row->gap - at < len ? row->gap - at : len;
+        abAppend(ab, row->chars + at, n);
+        at += n; len -= n;
+    }
+    if (len > 0) abAppend(ab, rowTail(row) + (at - row->gap), len);
+}
+
+/* Append src[from..size) to the end of dst */
+void rowAppendRow(arena *a, erow *dst, erow *src, int from) {
+    int n = src->size - from;
+    if (n == 0) return;
+    int plain = dst->flags & src->flags & ROW_PLAIN;
+    rowChanged(a, dst);
+    dst->flags |= plain;
+    rowReserve(a, dst, n);
+    rowMoveGap(a, dst, dst->size);
+    rowCopy(src, from, n, dst->chars + dst->gap);
+    dst->gap += n;
+    dst->size += n;
+}
+
+void rowFree(arena *a, erow *row) {
+    rowChanged(a, row);
+    if (!(row->flags & ROW_MAPPED)) arenaFree(a, row->chars, row->cap);
+    row->chars = NULL;
+    row->size = row->cap = row->gap = 0;
+    row->flags = 0;
+}
+
+/* Document B+tree */
+docnode *docNewNode(int leaf) {
+    docnode *x = calloc(1, sizeof(docnode));
+    if (x == NULL) die("calloc");
+    x->leaf = leaf;
+    x->stale = 1;
+    return x;
+}
+
+/* Row at index 'at' (0 <= at < count) */
+erow *docRow(document *d, int at) {
+    docnode *h = d->hint;
+    if (h) {
+        if (at >= d->hint_start && at < d->hint_start + h->n)
+            return &h->rows[at - d->hint_start];
+        if (at == d->hint_start + h->n && h->next) {
+            d->hint_start += h->n;
+            d->hint = h->next;
+            return &d->hint->rows[0];
+        }
+        if (at == d->hint_start - 1 && h->prev) {
+            d->hint = h->prev;
+            d->hint_start -= d->hint->n;
+            return &d->hint->rows[d->hint->n - 1];
+        }
+    }
+    docnode *x = d->root;
+    int start = 0;
+    while (!x->leaf) {
+        int i = 0;
+        while (at >= start + x->child[i]->count) start += x->child[i++]->count;
+        x = x->child[i];
+    }
+    d->hint = x;
+    d->hint_start = start;
+    return &x->rows[at - start];
+}
+
+/* Split off a new right sibling holding entries from..n-1 of x */
+docnode *docSplit(docnode *x, int from) {
+    docnode *y = docNewNode(x->leaf);
+    y->n = x->n - from;
+    if (x->leaf) {
+        memcpy(y->rows, &x->rows[from], sizeof(erow) * y->n);
+        y->count = y->n;
+        y->prev = x;
+        y->next = x->next;
+        if (x->next) x->next->prev = y;
+        x->next = y;
+    } else {
+        memcpy(y->child, &x->child[from], sizeof(docnode *) * y->n);
+        for (int i = 0; i < y->n; i++) y->count += y->child[i]->count;
+    }
+    x->n = from;
+    x->count -= y->count;
+    return y;
+}
+
+/* Insert an empty row at 'at' below x. Returns a new right sibling if x had
+ * to split. A node that overflows at its end keeps its entries and starts a
+ * new node, so appending (e.g. loading a file) leaves the tree packed. */
+docnode *docNodeInsert(docnode *x, int at, erow **out) {
+    docnode *y = NULL, *t = x;
+    x->stale = 1;
+    if (x->leaf) {
+        if (x->n == DOC_LEAF_MAX) {
+            y = docSplit(x, at == x->n ? x->n : x->n / 2);
+            if (at >= x->n) { at -= x->n; t = y; }
+        }
+        memmove(&t->rows[at + 1], &t->rows[at], sizeof(erow) * (t->n - at));
+        memset(&t->rows[at], 0, sizeof(erow));
+        t->n++;
+        t->count++;
+        *out = &t->rows[at];
+        return y;
+    }
+
+    int i = 0;
+    while (i < x->n - 1 && at > x->child[i]->count) at -= x->child[i++]->count;
+    docnode *nc = docNodeInsert(x->child[i], at, out);
+    x->count++;
+    if (nc == NULL) return NULL;
+
+    // x->count already includes the rows that moved to nc
+    int pos = i + 1;
+    if (x->n == DOC_FANOUT) {
+        y = docSplit(x, pos == x->n ? x->n : x->n / 2);
+        if (pos >= x->n) {
+            pos -= x->n;
+            t = y;
+            x->count -= nc->count;
+            y->count += nc->count;
+        }
+    }
+    memmove(&t->child[pos + 1], &t->child[pos], sizeof(docnode *) * (t->n - pos));
+    t->child[pos] = nc;
+    t->n++;
+    return y;
+}
+
+/* Insert an empty row at 'at' (0 <= at <= count) and return it */
+erow *docInsert(document *d, int at) {
+    erow *row;
+    docnode *y = docNodeInsert(d->root, at, &row);
+    if (y) {
+        docnode *r = docNewNode(0);
+        r->child[0] = d->root;
+        r->child[1] = y;
+        r->n = 2;
+        r->count = d->root->count + y->count;
+        d->root = r;
+    }
+    d->hint = NULL;
+    return row;
+}
+
+/* Fold node b (the right neighbour of a) into a */
+void docMerge(docnode *a, docnode *b) {
+    if (a->leaf) {
+        memcpy(&a->rows[a->n], b->rows, sizeof(erow) * b->n);
+        a->next = b->next;
+        if (b->next) b->next->prev = a;
+    } else {
+        memcpy(&a->child[a->n], b->child, sizeof(docnode *) * b->n);
+    }
+    a->n += b->n;
+    a->count += b->count;
+    a->stale = 1;
+    free(b);
+}
+
+/* Remove the row at 'at' below x; the caller has released its text.
+ * Underfull children are merged into a neighbour when they fit. */
+void docNodeDelete(docnode *x, int at) {
+    x->count--;
+    x->stale = 1;
+    if (x->leaf) {
+        memmove(&x->rows[at], &x->rows[at + 1], sizeof(erow) * (x->n - at - 1));
+        x->n--;
+        return;
+    }
+
+    int i = 0;
+    while (at >= x->child[i]->count) at -= x->child[i++]->count;
+    docnode *c = x->child[i];
+    docNodeDelete(c, at);
+
+    int max = c->leaf ? DOC_LEAF_MAX : DOC_FANOUT;
+    if (c->n > max / 4) return;
+    int j = -1; // merge child[j + 1] into child[j]
+    if (i > 0 && x->child[i - 1]->n + c->n <= max) j = i - 1;
+    else if (i + 1 < x->n && x->child[i + 1]->n + c->n <= max) j = i;
+    if (j < 0) {
+        if (c->n > 0) return;
+        // an empty child with full neighbours: just drop it
+        if (c->leaf) {
+            if (c->prev) c->prev->next = c->next;
+            if (c->next) c->next->prev = c->prev;
+        }
+        free(c);
+        memmove(&x->child[i], &x->child[i + 1], sizeof(docnode *) * (x->n - i - 1));
+        x->n--;
+        return;
+    }
+    docMerge(x->child[j], x->child[j + 1]);
+    memmove(&x->child[j + 1], &x->child[j + 2], sizeof(docnode *) * (x->n - j - 2));
+    x->n--;
+}
+
+/* Remove the row at 'at'; the caller has released its text */
+void docDelete(document *d, int at) {
+    docNodeDelete(d->root, at);
+    d->deletes++;
+    while (!d->root->leaf && d->root->n == 1) {
+        docnode *r = d->root;
+        d->root = r->child[0];
+        free(r);
+    }
+    if (!d->root->leaf && d->root->n == 0) {
+        free(d->root);
+        d->root = docNewNode(1);
+    }
+    d->hint = NULL;
+}
+
+void docInit(document *d) {
+    d->root = docNewNode(1);
+    d->hint = NULL;
+    d->hint_start = 0;
+    d->map = NULL;
+    d->maplen = d->disklen = 0;
+    d->loading = 0;
+    d->load_off = d->load_start = 0;
+    memset(&d->mem, 0, sizeof(d->mem));
+    memset(&d->undo, 0, sizeof(d->undo));
+    d->hl_valid = d->hl_top = 0;
+    d->hl_mark = -1;
+}
+
+/* Free the nodes only: row text goes with the arena */
+void docNodeFree(docnode *x) {
+    if (!x->leaf)
+        for (int i = 0; i < x->n; i++) docNodeFree(x->child[i]);
+    free(x);
+}
+
+void docFree(document *d) {
+    if (d->root) docNodeFree(d->root);
+    d->root = NULL;
+    d->hint = NULL;
+    if (d->map) munmap(d->map, d->maplen);
+    d->map = NULL;
+    d->maplen = 0;
+    d->loading = 0;
+    arenaRelease(&d->mem);
+}
+
+/* Soft wrap line counts */
+int wrapSegments(erow *row, int rx, int *cseg, int from, int *starts, int max);
+
+int wrapRowLines(erow *row) {
+    return wrapSegments(row, -1, NULL, 0, NULL, 0);
+}
+
+/* Screen lines of the subtree at x, recounting the stale parts */
+long docNodeLines(docnode *x) {
+    if (!x->stale) return x->lines;
+    long n = 0;
+    for (int i = 0; i < x->n; i++)
+        n += x->leaf ? wrapRowLines(&x->rows[i]) : docNodeLines(x->child[i]);
+    x->lines = n;
+    x->stale = 0;
+    return n;
+}
+
+/* The text of row 'at' changed */
+void docTouch(document *d, int at) {
+    if (at >= d->root->count) return;
+    docnode *x = d->root;
+    while (1) {
+        x->stale = 1;
+        if (x->leaf) return;
+        int i = 0;
+        while (at >= x->child[i]->count) at -= x->child[i++]->count;
+        x = x->child[i];
+    }
+}
+
+/* Every count is off (the width changed) */
+void docNodeStaleAll(docnode *x) {
+    x->stale = 1;
+    if (!x->leaf)
+        for (int i = 0; i < x->n; i++) docNodeStaleAll(x->child[i]);
+}
+
+/* Screen lines before row 'at' */
+long docLinesBefore(document *d, int at) {
+    docnode *x = d->root;
+    long lines = 0;
+    while (!x->leaf) {
+        int i = 0;
+        while (i < x->n - 1 && at >= x->child[i]->count) {
+            lines += docNodeLines(x->child[i]);
+            at -= x->child[i++]->count;
+        }
+        x = x->child[i];
+    }
+    if (at >= x->n) return lines + docNodeLines(x); // past the last row
+    for (int i = 0; i < at; i++) lines += wrapRowLines(&x->rows[i]);
+    return lines;
+}
+
+/* The row shown on screen line 'line'; *seg receives which of its lines it
+ * is. Past the end: the row count, segment 0. */
+int docRowAtLine(document *d, long line, int *seg) {
+    docnode *x = d->root;
+    int at = 0;
+    *seg = 0;
+    if (line < 0) return 0;
+    while (!x->leaf) {
+        int i = 0;
+        long l;
+        while (i < x->n - 1 && line >= (l = docNodeLines(x->child[i]))) {
+            line -= l;
+            at += x->child[i++]->count;
+        }
+        x = x->child[i];
+    }
+    for (int i = 0; i < x->n; i++) {
+        int h = wrapRowLines(&x->rows[i]);
+        if (line < h) { *seg = line; return at + i; }
+        line -= h;
+    }
+    return at + x->n;
+}
+
+/* Row operations */
+erow *editorRow(int at) {
+    return docRow(&E.doc, at);
+}
+
+erow *editorInsertRow(int at, const char *s, size_t len) {
+    erow *row = docInsert(&E.doc, at);
+    if (len) {
+        row->chars = arenaAlloc(&E.doc.mem, len, &row->cap);
+        memcpy(row->chars, s, len);
+        row->size = row->gap = len;
+    }
+    E.numrows++;
+    E.dirty = 1;
+    return row;
+}
+
+void editorAppendRow(char *s, size_t len) {
+    editorInsertRow(E.numrows, s, len);
+}
+
+/* Insert a row that borrows its text from the file mapping */
+void editorInsertMappedRow(int at, const char *s, size_t len) {
+    erow *row = docInsert(&E.doc, at);
+    if (len) {
+        // an empty line keeps chars NULL: it owns nothing, mapped or not
+        row->chars = (char *)s;
+        row->size = row->cap = row->gap = len;
+        row->flags = ROW_MAPPED;
+    }
+    E.numrows++;
+}
+
+void editorAppendMappedRow(const char *s, size_t len) {
+    editorInsertMappedRow(E.numrows, s, len);
+}
+
+void editorDelRow(int at) {
+    rowFree(&E.doc.mem, editorRow(at));
+    docDelete(&E.doc, at);
+    E.numrows--;
+    E.dirty = 1;
+}
+
+void editorFreeRows() {
+    editorSaveCollect(1); // the save may still be reading the rows
+    compactAbort();
+    docFree(&E.doc);
+    docInit(&E.doc);
+    E.numrows = 0;
+}
+
+/* Idle-time compaction.
+ * Edits leave the arena with blocks that hold mostly free-list entries and
+ * rows whose gap outgrew their text, and free() alone rarely gives memory
+ * back to the system. Once COMPACT_CHURN bytes have been freed and no input
+ * came for COMPACT_IDLE ms, the event loop runs the compactor in slices of
+ * COMPACT_SLICE ms, as it does the lexer; a key stops it between slices and
+ * it goes on from there afterwards.
+ *  census:   walk the rows, trim gaps of over COMPACT_GAP bytes (not on the
+ *            cursor row, which is being typed on) and count the live bytes
+ *            of every arena block;
+ *  pick:     blocks under a quarter full become victims, and their entries
+ *            are taken off the free lists so nothing new goes there;
+ *  evacuate: walk the rows again, copying text out of the victims and
+ *            dropping render caches in them (they are rebuilt when drawn);
+ *  release:  free the victims and hand the heap's free pages back.
+ * A save in progress pins the arena, and the compactor waits for it. */
+#define COMPACT_IDLE 1000
+#define COMPACT_CHURN (4 << 20)
+#define COMPACT_SLICE 5
+#define COMPACT_GAP 256
+
+enum { COMPACT_OFF, COMPACT_CENSUS, COMPACT_PICK, COMPACT_EVACUATE, COMPACT_RELEASE };
+
+struct {
+    int phase;
+    int row;                // next row to visit
+    unsigned deletes;       // E.doc.deletes when the walk started
+    int cls;                // next free list to filter (pick)
+    struct cblock { char *p; size_t live; } *blocks; // census, sorted by address
+    int nblocks;
+} compact;
+
+int compactCmpBlock(const void *a, const void *b) {
+    const char *x = ((const struct cblock *)a)->p, *y = ((const struct cblock *)b)->p;
+    return x < y ? -1 : x > y;
+}
+
+int compactCmpPtr(const void *a, const void *b) {
+    const char *x = *(char *const *)a, *y = *(char *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Drop the cycle under way (the document is going away or being parked).
+ * Victims stay victims: their free entries are already gone. */
+void compactAbort() {
+    free(compact.blocks);
+    compact.blocks = NULL;
+    compact.nblocks = 0;
+    compact.phase = COMPACT_OFF;
+}
+
+/* Milliseconds until the compactor wants to run, or -1 */
+int compactTimeout() {
+    if (compact.phase == COMPACT_OFF && E.doc.mem.churn < COMPACT_CHURN) return -1;
+    if (E.doc.mem.pinned) return -1; // the end of the save wakes the loop
+    long long ms = E.input_at + COMPACT_IDLE - monotonicMs();
+    return ms > 0 ? (int)ms : 0;
+}
+
+/* Count a small buffer towards its block's live bytes */
+void compactCount(const void *p, int cap) {
+    if (cap > ARENA_SMALL_MAX) return;
+    int lo = 0, hi = compact.nblocks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((const char *)p < compact.blocks[mid].p) hi = mid;
+        else if ((const char *)p >= compact.blocks[mid].p + ARENA_BLOCK) lo = mid + 1;
+        else { compact.blocks[mid].live += cap; return; }
+    }
+}
+
+/* Copy the row's text to a new buffer: just big enough (with the gap at
+ * the end) when 'trim', else the same size outside the victims */
+void compactMoveRow(arena *a, erow *row, int trim) {
+    int cap, tail = row->size - row->gap;
+    char *nc = arenaAlloc(a, trim ? row->size + ROW_MIN_CAP : row->cap, &cap);
+    memcpy(nc, row->chars, row->gap);
+    if (trim) {
+        memcpy(nc + row->gap, rowTail(row), tail);
+        row->gap = row->size;
+    } else {
+        memcpy(nc + cap - tail, rowTail(row), tail);
+    }
+    arenaFree(a, row->chars, row->cap);
+    row->chars = nc;
+    row->cap = cap;
+    row->flags &= ~ROW_SHARED;
+}
+
+/* Visit rows until the deadline; returns 1 when the walk is complete */
+int compactWalk(long long deadline) {
+    arena *a = &E.doc.mem;
+    if (compact.phase == COMPACT_EVACUATE && E.doc.deletes != compact.deletes) {
+        // rows were removed under the walk: one may have slid past it
+        compact.row = 0;
+        compact.deletes = E.doc.deletes;
+    }
+    while (compact.row < E.numrows) {
+        erow *row = editorRow(compact.row);
+        int owned = row->chars && !(row->flags & ROW_MAPPED);
+        if (compact.phase == COMPACT_CENSUS) {
+            if (owned && compact.row != E.cy && row->cap - row->size > COMPACT_GAP && row->cap > 2 * row->size)
+                compactMoveRow(a, row, 1);
+            if (owned) compactCount(row->chars, row->cap);
+            if (row->render) compactCount(row->render, row->render->cap);
+        } else {
+            if (owned && arenaVictim(a, row->chars)) compactMoveRow(a, row, 0);
+            if (row->render && arenaVictim(a, row->render)) {
+                arenaFree(a, row->render, row->render->cap);
+                row->render = NULL;
+            }
+        }
+        compact.row++;
+        if ((compact.row & 255) == 0 && monotonicMs() >= deadline) return 0;
+    }
+    return 1;
+}
+
+/* Choose the victims: sparse blocks, plus any left from a cycle cut short */
+void compactPick() {
+    arena *a = &E.doc.mem;
+    int n = a->nvictims;
+    for (int i = 0; i < compact.nblocks; i++)
+        if (compact.blocks[i].live < ARENA_BLOCK / 4 && compact.blocks[i].p != a->blocks->data &&
+            !arenaVictim(a, compact.blocks[i].p))
+            n++;
+    if (n == a->nvictims) return;
+    char **v = realloc(a->victims, sizeof(char *) * n);
+    if (v == NULL) die("realloc");
+    n = a->nvictims;
+    for (int i = 0; i < compact.nblocks; i++)
+        if (compact.blocks[i].live < ARENA_BLOCK / 4 && compact.blocks[i].p != a->blocks->data &&
+            !arenaVictim(a, compact.blocks[i].p))
+            v[n++] = compact.blocks[i].p;
+    qsort(v, n, sizeof(char *), compactCmpPtr);
+    a->victims = v;
+    a->nvictims = n;
+}
+
+/* Free the emptied blocks and return what the heap can spare */
+void compactRelease() {
+    arena *a = &E.doc.mem;
+    for (arenablock **pb = &a->blocks; *pb;) {
+        arenablock *blk = *pb;
+        if (arenaVictim(a, blk->data)) {
+            *pb = blk->next;
+            a->reserved -= sizeof(arenablock) + ARENA_BLOCK;
+            free(blk);
+        } else {
+            pb = &blk->next;
+        }
+    }
+    free(a->victims);
+    a->victims = NULL;
+    a->nvictims = 0;
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+/* One slice of the compactor */
+void compactSlice() {
+    arena *a = &E.doc.mem;
+    long long deadline = monotonicMs() + COMPACT_SLICE;
+    if (a->pinned) return;
+    switch (compact.phase) {
+    case COMPACT_OFF:
+        a->churn = 0;
+        compact.nblocks = 0;
+        for (arenablock *blk = a->blocks; blk; blk = blk->next) compact.nblocks++;
+        free(compact.blocks);
+        compact.blocks = malloc(sizeof(struct cblock) * (compact.nblocks + 1));
+        if (compact.blocks == NULL) die("malloc");
+        compact.nblocks = 0;
+        for (arenablock *blk = a->blocks; blk; blk = blk->next)
+            compact.blocks[compact.nblocks++] = (struct cblock){blk->data, 0};
+        qsort(compact.blocks, compact.nblocks, sizeof(struct cblock), compactCmpBlock);
+        compact.row = 0;
+        compact.phase = COMPACT_CENSUS;
+        break;
+    case COMPACT_CENSUS:
+        if (!compactWalk(deadline)) break;
+        compactPick();
+        compact.cls = 0;
+        compact.phase = a->nvictims ? COMPACT_PICK : COMPACT_RELEASE;
+        break;
+    case COMPACT_PICK: {
+        // take the victims' entries off one free list per slice
+        void **pp = &a->freelist[compact.cls];
+        while (*pp) {
+            if (arenaVictim(a, *pp)) *pp = *(void **)*pp;
+            else pp = (void **)*pp;
+        }
+        if (++compact.cls < ARENA_CLASSES) break;
+        compact.row = 0;
+        compact.deletes = E.doc.deletes;
+        compact.phase = COMPACT_EVACUATE;
+        break; }
+    case COMPACT_EVACUATE:
+        if (compactWalk(deadline)) compact.phase = COMPACT_RELEASE;
+        break;
+    case COMPACT_RELEASE:
+        compactRelease();
+        a->churn = 0; // our own frees don't count as churn
+        compactAbort(); // done
+        break;
+    }
+}
+
+/* Undo log */
+#define UNDO_RECSIZE(len) ((int)sizeof(undorec) + (((len) + 3) & ~3))
+
+undorec *undoAt(undochunk *c, int off) {
+    return (undorec *)(c->data + off);
+}
+
+char *undoText(undorec *r) {
+    return (char *)(r + 1);
+}
+
+/* Forget what redo would apply: the records after the position */
+void undoTruncate(undolog *u) {
+    undochunk *c = u->cur;
+    if (c == NULL) return;
+    while (c->next) {
+        undochunk *n = c->next;
+        c->next = n->next;
+        u->bytes -= n->size;
+        arenaFree(&E.doc.mem, n, n->size);
+    }
+    if (u->curoff < c->used) {
+        c->last = undoAt(c, u->curoff)->prev;
+        c->used = u->curoff;
+    }
+}
+
+/* Drop the oldest chunks while the log is over its limit. A group that
+ * loses records can no longer be undone, nor can anything before it. */
+void undoEvict(undolog *u) {
+    while (u->bytes > UNDO_LIMIT && u->first != u->cur) {
+        undochunk *c = u->first;
+        if (c->last >= 0) u->evicted = undoAt(c, c->last)->group;
+        u->first = c->next;
+        u->first->prev = NULL;
+        u->bytes -= c->size;
+        arenaFree(&E.doc.mem, c, c->size);
+    }
+}
+
+/* Append a record for len bytes of text, which the caller fills in. With
+ * 'join' it belongs to the same group (undo step) as the one before. */
+undorec *undoAdd(int type, int row, int col, int len, int join) {
+    undolog *u = &E.doc.undo;
+    undoTruncate(u);
+    if (!join || u->group == 0) u->group++;
+    int need = UNDO_RECSIZE(len);
+    undochunk *c = u->cur;
+    if (c == NULL || c->size - (int)sizeof(undochunk) - c->used < need) {
+        int want = need > UNDO_CHUNK ? need : UNDO_CHUNK;
+        int size;
+        undochunk *n = arenaAlloc(&E.doc.mem, sizeof(undochunk) + want, &size);
+        n->size = size;
+        n->used = 0;
+        n->last = -1;
+        n->prev = c;
+        n->next = NULL;
+        if (c) c->next = n;
+        else u->first = n;
+        u->cur = c = n;
+        u->bytes += size;
+    }
+    undorec *r = undoAt(c, c->used);
+    r->type = type;
+    r->newrow = 0;
+    r->row = row;
+    r->col = col;
+    r->len = len;
+    r->prev = c->last;
+    r->group = u->group;
+    c->last = c->used;
+    c->used += need;
+    u->curoff = c->used;
+    undoEvict(u);
+    return r;
+}
+
+/* Log an edit whose text is s */
+void undoLog(int type, int row, int col, const char *s, int len, int join) {
+    undorec *r = undoAdd(type, row, col, len, join);
+    r->newrow = row == E.numrows;
+    memcpy(undoText(r), s, len);
+    swapAppend(type, r->newrow, row, col, s, len);
+}
+
+/* The newest record, as long as nothing has been undone since */
+undorec *undoLast() {
+    undolog *u = &E.doc.undo;
+    undochunk *c = u->cur;
+    if (c == NULL || c->next || u->curoff != c->used || c->last < 0) return NULL;
+    return undoAt(c, c->last);
+}
+
+/* A typed character: it extends the record it continues */
+void undoTyped(int row, int col, char ch) {
+    undochunk *c = E.doc.undo.cur;
+    undorec *r = undoLast();
+    int cont = r && r->type == UNDO_INSERT && r->row == row && r->col + r->len == col;
+    if (cont) {
+        int grow = UNDO_RECSIZE(r->len + 1) - UNDO_RECSIZE(r->len);
+        if (c->size - (int)sizeof(undochunk) - c->used >= grow) {
+            undoText(r)[r->len++] = ch;
+            c->used += grow;
+            E.doc.undo.curoff = c->used;
+            swapAppend(UNDO_INSERT, 0, row, col, &ch, 1);
+            return;
+        }
+    }
+    undoLog(UNDO_INSERT, row, col, &ch, 1, cont);
+}
+
+/* The record the position is past (what undo applies next), or NULL. With
+ * 'move' the position steps back over it. */
+undorec *undoBack(undolog *u, int move) {
+    undochunk *c = u->cur;
+    int off = u->curoff;
+    while (c && off == 0) {
+        c = c->prev;
+        if (c) off = c->used;
+    }
+    if (c == NULL) return NULL;
+    int at = off == c->used ? c->last : undoAt(c, off)->prev;
+    undorec *r = undoAt(c, at);
+    if (r->group <= u->evicted) return NULL;
+    if (move) {
+        u->cur = c;
+        u->curoff = at;
+    }
+    return r;
+}
+
+/* The record after the position (what redo applies next), or NULL */
+undorec *undoForward(undolog *u, int move) {
+    undochunk *c = u->cur;
+    int off = u->curoff;
+    while (c && off == c->used) {
+        c = c->next;
+        off = 0;
+    }
+    if (c == NULL) return NULL;
+    undorec *r = undoAt(c, off);
+    if (move) {
+        u->cur = c;
+        u->curoff = off + UNDO_RECSIZE(r->len);
+    }
+    return r;
+}
+
+/* Line indexing.
+ * lineIndexScan() finds the '\n' bytes of a buffer and stores their offsets;
+ * opening a file is this scan plus one row per offset. The vector versions
+ * compare 64 bytes at a time (SSE2/AVX2 on x86-64, NEON on ARM), fold the
+ * result into a bitmask and walk it with ctz. A '\r' only matters right
+ * before a '\n', so callers trim it from the line end instead of scanning
+ * for it. */
+typedef size_t (*lineIndexFn)(const char *buf, size_t len, size_t base, size_t *nl, size_t max, size_t *scanned);
+
+/* Store base + offset of each '\n' in buf[0..len) into nl[] (at most max,
+ * which must be >= 64) and return how many were stored. *scanned is how much
+ * of buf was covered: len, unless nl[] filled up first. */
+size_t lineIndexScanScalar(const char *buf, size_t len, size_t base, size_t *nl, size_t max, size_t *scanned) {
+    size_t n = 0, i = 0;
+    for (; i < len && n < max; i++)
+        if (buf[i] == '\n') nl[n++] = base + i;
+    *scanned = i;
+    return n;
+}
+
+/* Emit the offsets of the set bits of a 64-byte block mask */
+#define LINEINDEX_EMIT(mask, off) \
+    while (mask) { nl[n++] = (off) + __builtin_ctzll(mask); mask &= mask - 1; }
+
+/* Finish the last partial block with the scalar loop */
+#define LINEINDEX_TAIL() do { \
+    size_t tail; \
+    n += lineIndexScanScalar(buf + i, len - i, base + i, nl + n, max - n, &tail); \
+    *scanned = i + tail; \
+} while (0)
+
+#if defined(__x86_64__)
+size_t lineIndexScanSSE2(const char *buf, size_t len, size_t base, size_t *nl, size_t max, size_t *scanned) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 64 <= len && max - n >= 64; i += 64) {
+        const __m128i *p = (const __m128i *)(buf + i);
+        uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), lf));
+        uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 1), lf));
+        uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), lf));
+        uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 3), lf));
+        uint64_t mask = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+        LINEINDEX_EMIT(mask, base + i);
+    }
+    LINEINDEX_TAIL();
+    return n;
+}
+
+__attribute__((target("avx2")))
+size_t lineIndexScanAVX2(const char *buf, size_t len, size_t base, size_t *nl, size_t max, size_t *scanned) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 64 <= len && max - n >= 64; i += 64) {
+        const __m256i *p = (const __m256i *)(buf + i);
+        uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p), lf));
+        uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), lf));
+        uint64_t mask = lo | (hi << 32);
+        LINEINDEX_EMIT(mask, base + i);
+    }
+    LINEINDEX_TAIL();
+    return n;
+}
+#endif
+
+#if defined(__aarch64__)
+/* NEON has no movemask: narrow each 16-byte compare to 4 bits per byte */
+uint64_t lineIndexMaskNEON(const uint8_t *p, uint8x16_t lf) {
+    uint8x16_t eq = vceqq_u8(vld1q_u8(p), lf);
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+size_t lineIndexScanNEON(const char *buf, size_t len, size_t base, size_t *nl, size_t max, size_t *scanned) {
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 64 <= len && max - n >= 64; i += 64) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t mask = lineIndexMaskNEON((const uint8_t *)buf + i + k * 16, lf);
+            while (mask) {
+                nl[n++] = base + i + k * 16 + (__builtin_ctzll(mask) >> 2);
+                mask &= ~(0xFULL << (__builtin_ctzll(mask) & ~3));
+            }
+        }
+    }
+    LINEINDEX_TAIL();
+    return n;
+}
+#endif
+
+struct lineIndexImpl {
+    const char *name;
+    lineIndexFn fn;
+    int supported;
+};
+
+/* Every implementation built into this binary, best last */
+int lineIndexImpls(struct lineIndexImpl *out) {
+    int n = 0;
+    out[n++] = (struct lineIndexImpl){"scalar", lineIndexScanScalar, 1};
+#if defined(__x86_64__)
+    out[n++] = (struct lineIndexImpl){"sse2", lineIndexScanSSE2, 1};
+    __builtin_cpu_init();
+    out[n++] = (struct lineIndexImpl){"avx2", lineIndexScanAVX2, __builtin_cpu_supports("avx2")};
+#elif defined(__aarch64__)
+    out[n++] = (struct lineIndexImpl){"neon", lineIndexScanNEON, 1};
+#endif
+    return n;
+}
+
+lineIndexFn lineIndexBest = lineIndexScanScalar; // set by simdInit
+
+size_t lineIndexScan(const char *buf, size_t len, size_t base, size_t *nl, size_t max, size_t *scanned) {
+    return lineIndexBest(buf, len, base, nl, max, scanned);
+}
+
+/* Substring search.
+ * findSubstr() uses a first/last byte filter: it compares the first and last
+ * byte of the needle against 32 (AVX2) or 16 (SSE2, NEON) candidate
+ * positions at once and runs memcmp only where both match, which on real
+ * text is rarely. Dispatch works like lineIndexScan. */
+typedef const char *(*findFn)(const char *hay, size_t len, const char *needle, size_t nlen);
+
+/* Check the candidates set in mask, lowest first */
+#define FIND_VERIFY(mask, off) \
+    while (mask) { \
+        const char *c = hay + (off) + __builtin_ctz(mask); \
+        if (memcmp(c + 1, needle + 1, nlen - 2) == 0) return c; \
+        mask &= mask - 1; \
+    }
+
+const char *findSubstrScalar(const char *hay, size_t len, const char *needle, size_t nlen) {
+    return memmem(hay, len, needle, nlen);
+}
+
+/* The positions i..len-nlen the vector loop did not cover */
+const char *findSubstrTail(const char *hay, size_t i, size_t len, const char *needle, size_t nlen) {
+    for (; i + nlen <= len; i++)
+        if (hay[i] == needle[0] && memcmp(hay + i + 1, needle + 1, nlen - 1) == 0) return hay + i;
+    return NULL;
+}
+
+#if defined(__x86_64__)
+const char *findSubstrSSE2(const char *hay, size_t len, const char *needle, size_t nlen) {
+    if (nlen < 2 || nlen > len) return findSubstrScalar(hay, len, needle, nlen);
+    const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[nlen - 1]);
+    size_t i = 0, end = len - nlen + 1; // candidate starts are 0..end-1
+    for (; i + 16 <= end; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + nlen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        FIND_VERIFY(mask, i);
+    }
+    return findSubstrTail(hay, i, len, needle, nlen);
+}
+
+__attribute__((target("avx2")))
+const char *findSubstrAVX2(const char *hay, size_t len, const char *needle, size_t nlen) {
+    if (nlen < 2 || nlen > len) return findSubstrScalar(hay, len, needle, nlen);
+    const __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[nlen - 1]);
+    size_t i = 0, end = len - nlen + 1;
+    for (; i + 32 <= end; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        FIND_VERIFY(mask, i);
+    }
+    return findSubstrTail(hay, i, len, needle, nlen);
+}
+#endif
+
+#if defined(__aarch64__)
+const char *findSubstrNEON(const char *hay, size_t len, const char *needle, size_t nlen) {
+    if (nlen < 2 || nlen > len) return findSubstrScalar(hay, len, needle, nlen);
+    const uint8x16_t first = vdupq_n_u8(needle[0]), last = vdupq_n_u8(needle[nlen - 1]);
+    size_t i = 0, end = len - nlen + 1;
+    for (; i + 16 <= end; i += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)hay + i), first),
+                                 vceqq_u8(vld1q_u8((const uint8_t *)hay + i + nlen - 1), last));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask) {
+            const char *c = hay + i + (__builtin_ctzll(mask) >> 2);
+            if (memcmp(c + 1, needle + 1, nlen - 2) == 0) return c;
+            mask &= ~(0xFULL << (__builtin_ctzll(mask) & ~3));
+        }
+    }
+    return findSubstrTail(hay, i, len, needle, nlen);
+}
+#endif
+
+findFn findSubstrBest = findSubstrScalar; // set by simdInit
+
+const char *findSubstr(const char *hay, size_t len, const char *needle, size_t nlen) {
+    return findSubstrBest(hay, len, needle, nlen);
+}
+
+/* Row rendering.
+ * A row is checked once for bytes outside printable ASCII, 16 or 32 at a
+ * time; if there are none it gets ROW_PLAIN and draws as it is. Otherwise
+ * rowRender builds its rowrender: tabs expand to the next TAB_STOP, UTF-8
+ * characters take the width the terminal gives them (0 for combining
+ * marks, 2 for East Asian wide ones) and control characters or invalid
+ * bytes show as '?'. Either result lasts until the row changes, so drawing
+ * and cursor column math on an unchanged row are O(1) per character. */
+#define TAB_STOP 8
+
+typedef int (*plainFn)(const char *s, size_t len);
+
+int textPlainScalar(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if ((unsigned char)s[i] < 0x20 || (unsigned char)s[i] >= 0x7f) return 0;
+    return 1;
+}
+
+#if defined(__x86_64__)
+/* Signed compare: bytes >= 0x80 are negative, so one test covers < 0x20 too */
+int textPlainSSE2(const char *s, size_t len) {
+    const __m128i space = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)))) return 0;
+    }
+    return textPlainScalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+int textPlainAVX2(const char *s, size_t len) {
+    const __m256i space = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del)))) return 0;
+    }
+    return textPlainScalar(s + i, len - i);
+}
+#endif
+
+#if defined(__aarch64__)
+int textPlainNEON(const char *s, size_t len) {
+    const int8x16_t space = vdupq_n_s8(0x20);
+    const uint8x16_t del = vdupq_n_u8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        int8x16_t v = vld1q_s8((const int8_t *)s + i);
+        uint8x16_t bad = vorrq_u8(vcltq_s8(v, space), vceqq_u8(vreinterpretq_u8_s8(v), del));
+        if (vmaxvq_u8(bad)) return 0;
+    }
+    return textPlainScalar(s + i, len - i);
+}
+#endif
+
+/* Is s[0..len) printable ASCII? */
+plainFn textPlainBest = textPlainScalar; // set by simdInit
+
+int textPlain(const char *s, size_t len) {
+    return len == 0 || textPlainBest(s, len);
+}
+
+/* Pick the vector routines for this CPU. Called before any thread starts
+ * (from initEditor and poolInit), so the dispatchers above read the
+ * pointers without locking; until then they run the scalar versions. */
+void simdInit() {
+    struct lineIndexImpl impls[4];
+    int n = lineIndexImpls(impls);
+    for (int i = 0; i < n; i++) if (impls[i].supported) lineIndexBest = impls[i].fn;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    findSubstrBest = __builtin_cpu_supports("avx2") ? findSubstrAVX2 : findSubstrSSE2;
+    textPlainBest = __builtin_cpu_supports("avx2") ? textPlainAVX2 : textPlainSSE2;
+#elif defined(__aarch64__)
+    findSubstrBest = findSubstrNEON;
+    textPlainBest = textPlainNEON;
+#endif
+}
+
+/* Decode one UTF-8 character. Returns its length, or 0 if s does not start
+ * with a valid (shortest form) one. */
+int utf8Decode(const unsigned char *s, int len, unsigned *cp) {
+    int n;
+    unsigned c = s[0];
+    if (c < 0x80) { *cp = c; return 1; }
+    if (c >= 0xc2 && c <= 0xdf) { n = 2; c &= 0x1f; }
+    else if (c >= 0xe0 && c <= 0xef) { n = 3; c &= 0x0f; }
+    else if (c >= 0xf0 && c <= 0xf4) { n = 4; c &= 0x07; }
+    else return 0;
+    if (n > len) return 0;
+    for (int i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) return 0;
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff)) || (c >= 0xd800 && c <= 0xdfff))
+        return 0;
+    *cp = c;
+    return n;
+}
+
+struct charRange { unsigned first, last; };
+
+/* Zero-width: combining marks, joiners, variation selectors */
+static const struct charRange zeroWidth[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+    {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+    {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711},
+    {0x0730, 0x074a}, {0x07a6, 0x07b0}, {0x0900, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c},
+    {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a},
+    {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e},
+    {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0x302a, 0x302d}, {0x3099, 0x309a}, {0xfe00, 0xfe0f},
+    {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0xe0100, 0xe01ef},
+};
+
+/* Two columns: East Asian wide and fullwidth, most emoji */
+static const struct charRange doubleWidth[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267f, 0x267f},
+    {0x2693, 0x2693}, {0x26a1, 0x26a1}, {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b}, {0x2728, 0x2728},
+    {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27b0, 0x27b0}, {0x27bf, 0x27bf}, {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55},
+    {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf},
+    {0xa960, 0xa97f}, {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f},
+    {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4}, {0x17000, 0x18aff}, {0x1b000, 0x1b2ff},
+    {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f202},
+    {0x1f210, 0x1f23b}, {0x1f240, 0x1f248}, {0x1f250, 0x1f251}, {0x1f260, 0x1f265}, {0x1f300, 0x1f64f},
+    {0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd},
+};
+
+int inRanges(unsigned c, const struct charRange *r, int n) {
+    int lo = 0, hi = n - 1;
+    if (c < r[0].first || c > r[n - 1].last) return 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (c > r[mid].last) lo = mid + 1;
+        else if (c < r[mid].first) hi = mid - 1;
+        else return 1;
+    }
+    return 0;
+}
+
+/* Screen columns of a printable character */
+int charWidth(unsigned c) {
+    if (c < 0x300) return 1;
+    if (inRanges(c, zeroWidth, sizeof(zeroWidth) / sizeof(zeroWidth[0]))) return 0;
+    if (inRanges(c, doubleWidth, sizeof(doubleWidth) / sizeof(doubleWidth[0]))) return 2;
+    return 1;
+}
+
+/* The display form of the character at s: its width, and its render bytes
+ * (when out is not NULL). *n receives the bytes it takes in the row. */
+int renderChar(const unsigned char *s, int len, int col, char *out, int *rlen, int *n) {
+    unsigned c;
+    int k = utf8Decode(s, len, &c);
+    if (k == 0 || c < 0x20 || c == 0x7f || (c >= 0x80 && c < 0xa0)) {
+        *n = k ? k : 1;
+        if (c == '\t' && k) {
+            int w = TAB_STOP - col % TAB_STOP;
+            if (out) memset(out, ' ', w);
+            *rlen = w;
+            return w;
+        }
+        if (out) *out = '?';
+        *rlen = 1;
+        return 1;
+    }
+    *n = k;
+    if (out) memcpy(out, s, k);
+    *rlen = k;
+    return charWidth(c);
+}
+
+/* The render cache of a row, or NULL for a ROW_PLAIN one */
+rowrender *rowRender(arena *a, erow *row) {
+    if (row->flags & ROW_PLAIN) return NULL;
+    if (row->render) return row->render;
+    if (textPlain(row->chars, row->gap) && textPlain(rowTail(row), row->size - row->gap)) {
+        row->flags |= ROW_PLAIN;
+        return NULL;
+    }
+
+    static struct abuf text = ABUF_INIT; // the row without its gap
+    text.len = 0;
+    rowAppendTo(&text, row, 0, row->size);
+    const unsigned char *t = (const unsigned char *)text.b;
+
+    int rlen = 0, col = 0;
+    for (int i = 0; i < row->size;) {
+        int n, bytes;
+        col += renderChar(t + i, row->size - i, col, NULL, &bytes, &n);
+        rlen += bytes;
+        i += n;
+    }
+    int cap;
+    size_t maps = sizeof(int) * (row->size + 1);
+    rowrender *r = arenaAlloc(a, sizeof(rowrender) + 2 * maps + rlen, &cap);
+    r->cap = cap;
+    r->rx = r->maps;
+    r->ri = r->rx + row->size + 1;
+    r->render = (char *)(r->ri + row->size + 1);
+    r->rlen = rlen;
+    rlen = col = 0;
+    for (int i = 0; i < row->size;) {
+        int n, bytes;
+        int w = renderChar(t + i, row->size - i, col, r->render + rlen, &bytes, &n);
+        // every byte of a character starts where the character does
+        for (int k = 0; k < n; k++) {
+            r->rx[i + k] = col;
+            r->ri[i + k] = rlen;
+        }
+        col += w;
+        rlen += bytes;
+        i += n;
+    }
+    r->rx[row->size] = r->rsize = col;
+    r->ri[row->size] = rlen;
+    row->render = r;
+    return r;
+}
+
+/* Screen column of byte cx */
+int rowCxToRx(erow *row, int cx) {
+    rowrender *r = rowRender(&E.doc.mem, row);
+    return r ? r->rx[cx] : cx;
+}
+
+/* The character on screen column rx (the last one if rx is past the end) */
+int rowRxToCx(erow *row, int rx) {
+    rowrender *r = rowRender(&E.doc.mem, row);
+    if (r == NULL) return rx < row->size ? rx : row->size;
+    // last byte starting at or before rx, moved back to its character
+    int lo = 0, hi = row->size;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (r->rx[mid] <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    while (lo > 0 && lo < row->size && r->ri[lo - 1] == r->ri[lo]) lo--;
+    return lo;
+}
+
+/* Is byte i of the row inside a UTF-8 character (not where one starts)? */
+int rowIsCont(erow *row, int i) {
+    if (i <= 0 || i >= row->size) return 0;
+    rowrender *r = rowRender(&E.doc.mem, row);
+    return r && r->ri[i] == r->ri[i - 1];
+}
+
+/* Soft wrap layout. A row is cut into segments of E.screencols columns. A
+ * tab may be split between two; a wide character that would cross the
+ * edge starts the next segment. A row whose width is a multiple of the
+ * screen gets an empty last segment, where the cursor goes at its end. */
+struct wrapState {
+    int b;              // start column of the current segment
+    int segs;           // segments so far
+    int from, max;      // starts[] covers segments from .. from + max - 1
+    int *starts;
+    int rx, cseg;       // the segment holding column rx
+};
+
+void wrapBreak(struct wrapState *w, int at) {
+    w->b = at;
+    if (w->segs >= w->from && w->segs < w->from + w->max) w->starts[w->segs - w->from] = at;
+    if (at <= w->rx) w->cseg = w->segs;
+    w->segs++;
+}
+
+/* Lay a row out: the start columns of segments from .. from + max - 1 go
+ * to starts[], the segment holding screen column rx to *cseg (when rx >= 0).
+ * Returns the number of segments. */
+int wrapSegments(erow *row, int rx, int *cseg, int from, int *starts, int max) {
+    int W = E.screencols;
+    if (!(row->flags & ROW_PLAIN) && !row->render &&
+        textPlain(row->chars, row->gap) && textPlain(rowTail(row), row->size - row->gap))
+        row->flags |= ROW_PLAIN;
+    if (row->flags & ROW_PLAIN) {
+        int n = row->size / W + 1;
+        for (int k = from; k < from + max && k < n; k++) starts[k - from] = k * W;
+        if (cseg) *cseg = rx / W < n ? rx / W : n - 1;
+        return n;
+    }
+
+    static struct abuf text = ABUF_INIT;
+    const unsigned char *t = (const unsigned char *)row->chars;
+    if (row->gap < row->size) {
+        text.len = 0;
+        rowAppendTo(&text, row, 0, row->size);
+        t = (const unsigned char *)text.b;
+    }
+    struct wrapState w = {0, 0, from, max, starts, rx, 0};
+    wrapBreak(&w, 0);
+    int col = 0;
+    for (int i = 0; i < row->size;) {
+        int n, bytes;
+        int cw = renderChar(t + i, row->size - i, col, NULL, &bytes, &n);
+        while (col >= w.b + W) wrapBreak(&w, w.b + W);
+        if (col + cw > w.b + W && col > w.b && t[i] != '\t') wrapBreak(&w, col);
+        col += cw;
+        i += n;
+    }
+    while (col >= w.b + W) wrapBreak(&w, w.b + W);
+    if (cseg) *cseg = w.cseg;
+    return w.segs;
+}
+
+/* Start column of segment 'seg' of a row, and in *width its columns */
+int wrapSegmentStart(erow *row, int seg, int *width) {
+    int b[2];
+    int n = wrapSegments(row, -1, NULL, seg, b, 2);
+    *width = seg + 1 < n ? b[1] - b[0] : E.screencols;
+    return b[0];
+}
+
+/* Syntax highlighting.
+ * A lexer colours one row at a time. It starts in the state the previous
+ * row ended in (only "inside a block comment" for C) and returns the state
+ * at its end. Both states are cached in the row's flags. An edit lowers
+ * hl_valid to the edited row. hlSync lexes forward from there, skipping
+ * rows whose cached start state still holds. Once it is past the last edit
+ * (hl_mark) and a row is in step, every row up to hl_top is known to be
+ * right, so it jumps there. Drawing syncs only the rows on screen; the rest
+ * of the file is lexed while the editor is idle. */
+enum hlClass {
+    HL_NORMAL, HL_COMMENT, HL_KEYWORD, HL_TYPE, HL_STRING, HL_NUMBER, HL_PREPROC,
+    HL_ERROR, HL_WARN, HL_MATCH, HL_CURRENT,
+};
+
+// each one resets the attributes, so a colour change is one sequence
+static const char *hlSGR[] = {
+    "\x1b[m", "\x1b[0;36m", "\x1b[0;33m", "\x1b[0;32m", "\x1b[0;35m", "\x1b[0;31m", "\x1b[0;34m",
+    "\x1b[0;1;31m", "\x1b[0;1;33m", "\x1b[0;30;43m", "\x1b[0;7m",
+};
+
+enum { HLS_NORMAL, HLS_COMMENT };
+
+struct editorSyntax;
+// colours s[0..len) into hl (unless it is NULL) and returns the end state
+typedef int (*lexFn)(const struct editorSyntax *syn, const unsigned char *s, int len, int state, unsigned char *hl);
+
+struct editorSyntax {
+    const char *name;
+    const char **exts;      // file name endings
+    lexFn lex;
+    int multiline;          // rows can end in a state other than HLS_NORMAL
+    const char **keywords;
+    const char **types;
+};
+
+int hlIsWord(int c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+int hlInList(const char **list, const unsigned char *s, int len, int nocase) {
+    for (; list && *list; list++) {
+        if (nocase ? tolower((*list)[0]) != tolower(s[0]) : (*list)[0] != s[0]) continue;
+        if ((int)strlen(*list) != len) continue;
+        if (nocase ? strncasecmp(*list, (const char *)s, len) == 0 : memcmp(*list, s, len) == 0) return 1;
+    }
+    return 0;
+}
+
+/* End of the quoted string starting at s[i] (past the closing quote) */
+int hlSkipString(const unsigned char *s, int i, int len) {
+    int j = i + 1;
+    while (j < len && s[j] != s[i]) j += s[j] == '\\' ? 2 : 1;
+    return j < len ? j + 1 : len;
+}
+
+/* End of the number starting at s[i]: digits, letters (0x, suffixes), '.'
+ * and a sign after an exponent */
+int hlSkipNumber(const unsigned char *s, int i, int len) {
+    int j = i + 1;
+    while (j < len && (hlIsWord(s[j]) || s[j] == '.' ||
+                       ((s[j] == '+' || s[j] == '-') && strchr("eEpP", s[j - 1]))))
+        j++;
+    return j;
+}
+
+int lexC(const struct editorSyntax *syn, const unsigned char *s, int len, int state, unsigned char *hl) {
+    int i = 0, bol = 1; // bol: only blanks so far, so '#' starts a directive
+    while (i < len) {
+        unsigned char c = s[i];
+        int j = i + 1, cls = HL_NORMAL;
+        if (state == HLS_COMMENT) {
+            j = i;
+            while (j + 1 < len && !(s[j] == '*' && s[j + 1] == '/')) j++;
+            if (j + 1 < len) { j += 2; state = HLS_NORMAL; }
+            else j = len;
+            cls = HL_COMMENT;
+        } else if (c == '/' && i + 1 < len && s[i + 1] == '/') {
+            j = len;
+            cls = HL_COMMENT;
+        } else if (c == '/' && i + 1 < len && s[i + 1] == '*') {
+            j = i + 2;
+            state = HLS_COMMENT;
+            cls = HL_COMMENT;
+        } else if (c == '"' || c == '\'') {
+            j = hlSkipString(s, i, len);
+            cls = HL_STRING;
+        } else if (c == '#' && bol) {
+            while (j < len && (s[j] == ' ' || s[j] == '\t')) j++;
+            while (j < len && hlIsWord(s[j])) j++;
+            cls = HL_PREPROC;
+        } else if (isdigit(c) || (c == '.' && i + 1 < len && isdigit(s[i + 1]))) {
+            j = hlSkipNumber(s, i, len);
+            cls = HL_NUMBER;
+        } else if (hlIsWord(c)) {
+            while (j < len && hlIsWord(s[j])) j++;
+            if (hl == NULL) ; // only the state is wanted
+            else if (hlInList(syn->keywords, s + i, j - i, 0)) cls = HL_KEYWORD;
+            else if (hlInList(syn->types, s + i, j - i, 0)) cls = HL_TYPE;
+        }
+        if (cls != HL_NORMAL || (c != ' ' && c != '\t')) bol = 0;
+        if (hl) memset(hl + i, cls, j - i);
+        i = j;
+    }
+    return state;
+}
+
+/* NASM and GAS: ';' or '#' comments, labels, directives, the mnemonic */
+int lexAsm(const struct editorSyntax *syn, const unsigned char *s, int len, int state, unsigned char *hl) {
+    int i = 0, words = 0;
+    while (i < len) {
+        unsigned char c = s[i];
+        int j = i + 1, cls = HL_NORMAL;
+        if (c == ';' || c == '#') {
+            j = len;
+            cls = HL_COMMENT;
+        } else if (c == '"' || c == '\'' || c == '`') {
+            j = hlSkipString(s, i, len);
+            cls = HL_STRING;
+        } else if (isdigit(c)) {
+            j = hlSkipNumber(s, i, len);
+            cls = HL_NUMBER;
+        } else if (hlIsWord(c) || c == '.' || c == '%') {
+            while (j < len && (hlIsWord(s[j]) || s[j] == '.')) j++;
+            int k = j; // a label without ':' is followed by a data directive
+            while (k < len && (s[k] == ' ' || s[k] == '\t')) k++;
+            int e = k;
+            while (e < len && hlIsWord(s[e])) e++;
+            if (words == 0 && j < len && s[j] == ':') {
+                j++;
+                cls = HL_TYPE;
+            } else if (c == '.' || c == '%' || hlInList(syn->keywords, s + i, j - i, 1)) {
+                cls = HL_PREPROC;
+                words++;
+            } else if (words == 0 && e > k && hlInList(syn->types, s + k, e - k, 1)) {
+                cls = HL_TYPE;
+            } else {
+                if (words == 0) cls = HL_KEYWORD;
+                words++;
+            }
+        }
+        if (hl) memset(hl + i, cls, j - i);
+        i = j;
+    }
+    return state;
+}
+
+int lexJSON(const struct editorSyntax *syn, const unsigned char *s, int len, int state, unsigned char *hl) {
+    int i = 0;
+    while (i < len) {
+        unsigned char c = s[i];
+        int j = i + 1, cls = HL_NORMAL;
+        if (c == '"') {
+            j = hlSkipString(s, i, len);
+            int k = j;
+            while (k < len && (s[k] == ' ' || s[k] == '\t')) k++;
+            cls = k < len && s[k] == ':' ? HL_TYPE : HL_STRING; // keys apart from values
+        } else if (isdigit(c) || (c == '-' && i + 1 < len && isdigit(s[i + 1]))) {
+            j = hlSkipNumber(s, i, len);
+            cls = HL_NUMBER;
+        } else if (hlIsWord(c)) {
+            while (j < len && hlIsWord(s[j])) j++;
+            if (hlInList(syn->keywords, s + i, j - i, 0)) cls = HL_KEYWORD;
+        }
+        if (hl) memset(hl + i, cls, j - i);
+        i = j;
+    }
+    return state;
+}
+
+static const char *logErrors[] = {"error", "err", "fatal", "critical", "crit", "panic", "fail", "failed", "exception", NULL};
+static const char *logWarnings[] = {"warn", "warning", NULL};
+
+/* A leading timestamp, severity words and quoted strings */
+int lexLog(const struct editorSyntax *syn, const unsigned char *s, int len, int state, unsigned char *hl) {
+    int i = 0, digits = 0, stamp = 0;
+    if (len > 0 && s[0] == '[') i = 1;
+    while (i < len && (isdigit(s[i]) || strchr("-:./T,Z+", s[i]) ||
+                       (s[i] == ' ' && i + 1 < len && isdigit(s[i + 1])))) {
+        digits += isdigit(s[i]) != 0;
+        stamp |= s[i] == ':' || s[i] == '-';
+        i++;
+    }
+    if (digits >= 4 && stamp) {
+        if (s[0] == '[' && i < len && s[i] == ']') i++;
+        if (hl) memset(hl, HL_COMMENT, i);
+    } else {
+        i = 0;
+    }
+    while (i < len) {
+        unsigned char c = s[i];
+        int j = i + 1, cls = HL_NORMAL;
+        if (c == '"') {
+            j = hlSkipString(s, i, len);
+            cls = HL_STRING;
+        } else if (hlIsWord(c)) {
+            while (j < len && hlIsWord(s[j])) j++;
+            if (hlInList(logErrors, s + i, j - i, 1)) cls = HL_ERROR;
+            else if (hlInList(logWarnings, s + i, j - i, 1)) cls = HL_WARN;
+            else if (hlInList(syn->keywords, s + i, j - i, 1)) cls = HL_KEYWORD;
+        }
+        if (hl) memset(hl + i, cls, j - i);
+        i = j;
+    }
+    return state;
+}
+
+static const char *cExts[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hpp", ".hh", NULL};
+static const char *cKeywords[] = {
+    "auto", "break", "case", "const", "continue", "default", "do", "else", "enum", "extern",
+    "for", "goto", "if", "inline", "register", "restrict", "return", "sizeof", "static",
+    "struct", "switch", "typedef", "union", "volatile", "while", "class", "namespace",
+    "template", "typename", "public", "private", "protected", "virtual", "new", "delete",
+    "this", "true", "false", "nullptr", "NULL", "_Atomic", "_Static_assert", "static_assert", NULL};
+static const char *cTypes[] = {
+    "char", "short", "int", "long", "float", "double", "void", "signed", "unsigned", "bool",
+    "_Bool", "size_t", "ssize_t", "off_t", "int8_t", "int16_t", "int32_t", "int64_t",
+    "uint8_t", "uint16_t", "uint32_t", "uint64_t", "uintptr_t", "FILE", NULL};
+static const char *asmExts[] = {".asm", ".s", ".S", ".inc", NULL};
+static const char *asmDirectives[] = {
+    "section", "segment", "global", "extern", "bits", "default", "align", "times", "equ",
+    "org", "cpu", "rel", "abs", "incbin", "byte", "word", "dword", "qword", "ptr",
+    "db", "dw", "dd", "dq", "dt", "do", "dy", "resb", "resw", "resd", "resq", "rest", "reso", NULL};
+static const char *asmData[] = {
+    "db", "dw", "dd", "dq", "dt", "do", "dy", "resb", "resw", "resd", "resq", "rest", "reso", "equ", "times", NULL};
+static const char *jsonExts[] = {".json", NULL};
+static const char *jsonKeywords[] = {"true", "false", "null", NULL};
+static const char *logExts[] = {".log", NULL};
+static const char *logLevels[] = {"info", "notice", "debug", "trace", NULL};
+
+struct editorSyntax HLDB[] = {
+    {"c", cExts, lexC, 1, cKeywords, cTypes},
+    {"asm", asmExts, lexAsm, 0, asmDirectives, asmData},
+    {"json", jsonExts, lexJSON, 0, jsonKeywords, NULL},
+    {"log", logExts, lexLog, 0, logLevels, NULL},
+};
+
+/* Lex the first len bytes of a row that starts in 'state' into hl (NULL for
+ * just the state). Returns the state at the end (that of the row when len
+ * is its size). */
+int hlLexRow(erow *row, int len, int state, unsigned char *hl) {
+    static struct abuf text = ABUF_INIT; // the row without its gap
+    const unsigned char *t = (const unsigned char *)row->chars;
+    if (row->gap < len) {
+        text.len = 0;
+        rowAppendTo(&text, row, 0, len);
+        t = (const unsigned char *)text.b;
+    }
+    return E.syntax->lex(E.syntax, t, len, state, hl);
+}
+
+/* Row 'filerow' changed (delta 0), was inserted (1) or was removed (-1) */
+void hlInvalidate(int filerow, int delta) {
+    document *d = &E.doc;
+    if (filerow >= d->hl_top) return;
+    d->hl_top += delta;
+    if (d->hl_mark >= filerow) d->hl_mark += delta;
+    if (d->hl_mark < filerow) d->hl_mark = filerow;
+    if (d->hl_valid > filerow) d->hl_valid = filerow;
+}
+
+/* Bring the lexer states of the rows before 'upto' up to date. A row whose
+ * text is unchanged but starts in a new state is marked for repaint. */
+void hlSync(int upto) {
+    document *d = &E.doc;
+    if (E.syntax == NULL || !E.syntax->multiline) return;
+    if (upto > E.numrows) upto = E.numrows;
+    int state = d->hl_valid ? ROW_HL_END(editorRow(d->hl_valid - 1)) : HLS_NORMAL;
+    while (d->hl_valid < upto) {
+        int i = d->hl_valid;
+        erow *row = editorRow(i);
+        if ((row->flags & ROW_HLOK) && ROW_HL_START(row) == state) {
+            if (i > d->hl_mark && i + 1 < d->hl_top) {
+                // past the edits and in step: the rows up to hl_top are too
+                d->hl_valid = d->hl_top;
+                state = ROW_HL_END(editorRow(d->hl_valid - 1));
+                continue;
+            }
+            state = ROW_HL_END(row);
+        } else {
+            if (row->flags & ROW_HLOK) editorDamageRow(i); // same text, new colours
+            int end = hlLexRow(row, row->size, state, NULL);
+            row->flags = (row->flags & 0xffff) | ROW_HLOK | state << 16 | end << 24;
+            state = end;
+        }
+        d->hl_valid++;
+        if (d->hl_top < d->hl_valid) d->hl_top = d->hl_valid;
+    }
+}
+
+/* Lexer state at the start of a row (after hlSync has reached it) */
+int hlStartState(int filerow) {
+    if (!E.syntax->multiline || filerow == 0) return HLS_NORMAL;
+    return ROW_HL_END(editorRow(filerow - 1));
+}
+
+/* Rows past the visible ones still to be lexed */
+int hlPending() {
+    return E.syntax && E.syntax->multiline && E.doc.hl_valid < E.numrows;
+}
+
+/* Lex for a few milliseconds while there is no input */
+void hlSlice() {
+    struct timespec t0, t;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        hlSync(E.doc.hl_valid + 4096);
+        clock_gettime(CLOCK_MONOTONIC, &t);
+    } while (hlPending() && (t.tv_sec - t0.tv_sec) * 1000000000L + (t.tv_nsec - t0.tv_nsec) < 8000000L);
+}
+
+/* Pick the highlighting for the file name; a change relexes everything */
+void editorSelectSyntax() {
+    struct editorSyntax *syn = NULL;
+    size_t flen = strlen(E.filename);
+    for (size_t i = 0; i < sizeof(HLDB) / sizeof(HLDB[0]) && !syn; i++) {
+        for (const char **ext = HLDB[i].exts; *ext; ext++) {
+            size_t elen = strlen(*ext);
+            if (flen > elen && strcmp(E.filename + flen - elen, *ext) == 0) { syn = &HLDB[i]; break; }
+        }
+    }
+    if (syn == E.syntax) return;
+    E.syntax = syn;
+    for (int i = 0; i < E.numrows; i++) editorRow(i)->flags &= ~ROW_HLOK;
+    E.doc.hl_valid = E.doc.hl_top = 0;
+    E.doc.hl_mark = -1;
+    editorInvalidateScreen();
+}
+
+/* Swap journal.
+ * Until it is saved, every edit is also appended to .name.swp next to the
+ * file, in the form the undo log records it. Entries are batched and
+ * written with one fdatasync every SWAP_FLUSH_OPS edits or SWAP_FLUSH_MS,
+ * so the journal costs a syscall per batch, not per key, and grows with
+ * the edits rather than with the file. The header identifies the file the
+ * edits apply to; editorOpen offers to replay a journal that matches. */
+#define SWAP_FLUSH_OPS 256
+#define SWAP_FLUSH_MS 250
+
+struct swapHeader {
+    char magic[8];
+    int64_t size;           // of the file the edits apply to, -1 if none
+    int64_t mtime_sec, mtime_nsec;
+};
+
+struct swapEntry {
+    uint32_t sum;           // FNV-1a of the rest of the entry and its text
+    uint32_t len;
+    int32_t row, col;
+    uint8_t type, newrow;
+    uint8_t pad[2];
+};
+
+struct swapJournal {
+    int fd;                 // -1: not open
+    int failed;             // a write failed: stop journaling this file
+    char path[PATH_MAX];
+    off_t end;              // bytes on disk
+    struct abuf pending;    // entries not written yet
+    int nops;
+    struct timespec due;    // flush by then
+} swap = {-1, 0, "", 0, ABUF_INIT, 0, {0, 0}};
+
+#define SWAP_MAGIC "MNSWAP1\n"
+
+void swapPathFor(const char *filename, char *buf, size_t bufsz) {
+    const char *slash = strrchr(filename, '/');
+    if (slash)
+        snprintf(buf, bufsz, "%.*s.%s.swp", (int)(slash - filename + 1), filename, slash + 1);
+    else
+        snprintf(buf, bufsz, ".%s.swp", filename);
+}
+
+/* Identify the file the way it is on disk now */
+void swapIdentify(struct swapHeader *h) {
+    struct stat st;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SWAP_MAGIC, 8);
+    h->size = -1;
+    if (stat(E.filename, &st) == 0) {
+        h->size = st.st_size;
+        h->mtime_sec = st.st_mtim.tv_sec;
+        h->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+uint32_t swapSum(const struct swapEntry *e, const char *s, int len) {
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)e + sizeof(e->sum);
+    for (size_t i = 0; i < sizeof(*e) - sizeof(e->sum); i++) h = (h ^ p[i]) * 16777619u;
+    for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+/* Journal length, counting what is still to be written */
+off_t swapLength() {
+    return swap.fd == -1 ? 0 : swap.end + swap.pending.len;
+}
+
+int swapWriteAll(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+void swapFail(const char *what) {
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Swap file %s: %s", what, strerror(errno));
+    E.statusmsg_time = time(NULL);
+    if (swap.fd != -1) close(swap.fd);
+    swap.fd = -1;
+    swap.failed = 1;
+    swap.pending.len = 0;
+    swap.nops = 0;
+}
+
+/* Write the pending entries and make them durable */
+void swapFlush() {
+    if (swap.fd == -1 || swap.pending.len == 0) return;
+    if (swapWriteAll(swap.fd, swap.pending.b, swap.pending.len) == -1 || fdatasync(swap.fd) == -1) {
+        swapFail("write error");
+        return;
+    }
+    swap.end += swap.pending.len;
+    swap.pending.len = 0;
+    swap.nops = 0;
+}
+
+/* Milliseconds until the pending entries are due, or -1 */
+int swapTimeout() {
+    if (swap.nops == 0) return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (swap.due.tv_sec - now.tv_sec) * 1000LL + (swap.due.tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms + 1 : 0;
+}
+
+void swapTick() {
+    if (swap.nops && swapTimeout() == 0) swapFlush();
+}
+
+/* A new file next to the journal, to be renamed over it. mkstemp creates
+ * it exclusively, so a symlink planted at a guessable name in a shared
+ * directory is never followed. */
+int swapTemp(char *tmp, size_t size) {
+    snprintf(tmp, size, "%s.XXXXXX", swap.path);
+    int fd = mkstemp(tmp);
+    if (fd != -1) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/* Start a journal for the file as it is on disk */
+int swapCreate() {
+    swapPathFor(E.filename, swap.path, sizeof(swap.path));
+    char tmp[PATH_MAX + 8];
+    swap.fd = swapTemp(tmp, sizeof(tmp));
+    if (swap.fd != -1 && rename(tmp, swap.path) == -1) {
+        close(swap.fd);
+        unlink(tmp);
+        swap.fd = -1;
+    }
+    if (swap.fd == -1) {
+        swapFail("not created");
+        return -1;
+    }
+    struct swapHeader h;
+    swapIdentify(&h);
+    swap.end = 0;
+    swap.pending.len = 0;
+    abAppend(&swap.pending, (char *)&h, sizeof(h));
+    return 0;
+}
+
+void swapAppend(int type, int newrow, int row, int col, const char *s, int len) {
+    if (E.filename[0] == '\0' || swap.failed || E.batch) return;
+    if (swap.fd == -1 && swapCreate() == -1) return;
+    struct swapEntry e = {0, len, row, col, type, newrow, {0, 0}};
+    e.sum = swapSum(&e, s, len);
+    abAppend(&swap.pending, (char *)&e, sizeof(e));
+    abAppend(&swap.pending, s, len);
+    if (swap.nops++ == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &swap.due);
+        swap.due.tv_nsec += SWAP_FLUSH_MS * 1000000L;
+        swap.due.tv_sec += swap.due.tv_nsec / 1000000000L;
+        swap.due.tv_nsec %= 1000000000L;
+    }
+    if (swap.nops >= SWAP_FLUSH_OPS) swapFlush();
+}
+
+/* Stop journaling this file; with 'discard' the journal goes too */
+void swapClose(int discard) {
+    if (swap.fd != -1) {
+        if (discard) swap.pending.len = 0;
+        swapFlush();
+        if (swap.fd != -1) close(swap.fd);
+        if (discard) unlink(swap.path);
+    }
+    swap.fd = -1;
+    swap.failed = 0;
+    swap.pending.len = 0;
+    swap.nops = 0;
+}
+
+/* The file was saved with everything logged before 'from'. Start a new
+ * journal over it that keeps only the entries after that (edits made while
+ * the save was running), or none at all. */
+void swapRebase(off_t from) {
+    if (swap.fd == -1) return;
+    swapFlush();
+    if (swap.fd == -1) return;
+    if (from < (off_t)sizeof(struct swapHeader)) from = sizeof(struct swapHeader);
+    size_t n = swap.end - from;
+    if (n == 0) {
+        swapClose(1);
+        return;
+    }
+    char *tail = malloc(n);
+    if (tail == NULL) die("malloc");
+    ssize_t got = pread(swap.fd, tail, n, from);
+    close(swap.fd);
+    swap.fd = -1;
+    char tmp[PATH_MAX + 8];
+    struct swapHeader h;
+    swapIdentify(&h);
+    int fd = swapTemp(tmp, sizeof(tmp));
+    if (got != (ssize_t)n || fd == -1 || swapWriteAll(fd, (char *)&h, sizeof(h)) == -1 ||
+        swapWriteAll(fd, tail, n) == -1 || fdatasync(fd) == -1 || rename(tmp, swap.path) == -1) {
+        if (fd != -1) { close(fd); unlink(tmp); }
+        free(tail);
+        swapFail("not rewritten");
+        return;
+    }
+    free(tail);
+    swap.fd = fd;
+    swap.end = sizeof(h) + n;
+}
+
+/* After opening a file: if a journal for this very version of it is left
+ * over, offer to replay it. Replayed edits stay in the journal, which
+ * carries on from there. */
+void swapRecover() {
+    if (E.batch) return; // nobody to ask
+    char path[PATH_MAX];
+    swapPathFor(E.filename, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    struct swapHeader h, now;
+    swapIdentify(&now);
+    if (fstat(fd, &st) == -1 || st.st_size <= (off_t)sizeof(h)) {
+        // killed before the first batch was written: nothing to recover
+        close(fd);
+        unlink(path);
+        return;
+    }
+    if (read(fd, &h, sizeof(h)) != (ssize_t)sizeof(h) || memcmp(&h, &now, sizeof(h)) != 0) {
+        close(fd);
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Ignoring %.30s: it is for another version of the file", path);
+        E.statusmsg_time = time(NULL);
+        return;
+    }
+    char prompt[PATH_MAX + 64];
+    snprintf(prompt, sizeof(prompt), "Recover unsaved edits from %s? (y/N): ", path);
+    char *ans = editorPrompt(prompt, NULL);
+    int yes = ans && (ans[0] == 'y' || ans[0] == 'Y');
+    free(ans);
+    if (!yes) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+
+    size_t len = st.st_size - sizeof(h);
+    char *buf = malloc(len ? len : 1);
+    if (buf == NULL) die("malloc");
+    ssize_t got = pread(fd, buf, len, sizeof(h));
+    if (got < 0) got = 0;
+    editorLoadAll();
+    size_t off = 0;
+    long n = 0;
+    while (off + sizeof(struct swapEntry) <= (size_t)got) {
+        struct swapEntry e;
+        memcpy(&e, buf + off, sizeof(e));
+        const char *text = buf + off + sizeof(e);
+        // stop at a torn or garbled entry: nothing after it was synced
+        if (e.len > got - off - sizeof(e) || swapSum(&e, text, e.len) != e.sum) break;
+        if ((e.type != UNDO_INSERT && e.type != UNDO_DELETE) || e.row < 0 || e.col < 0) break;
+        if (e.newrow && e.type == UNDO_INSERT ? e.row != E.numrows
+                                              : e.row >= E.numrows || e.col > editorRow(e.row)->size) break;
+        editorApplyEdit(e.type, e.newrow, e.row, e.col, text, e.len);
+        off += sizeof(e) + e.len;
+        n++;
+    }
+    free(buf);
+    // keep the good prefix and append after it
+    if (ftruncate(fd, sizeof(h) + off) == -1 || lseek(fd, 0, SEEK_END) == -1) {
+        close(fd);
+    } else {
+        strcpy(swap.path, path);
+        swap.fd = fd;
+        swap.end = sizeof(h) + off;
+    }
+    E.cx = E.cy = 0;
+    E.dirty = n > 0;
+    editorInvalidateScreen();
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Recovered %ld edits from %.30s", n, path);
+    E.statusmsg_time = time(NULL);
+}
+
+/* File I/O */
+
+/* Split up to 'bytes' more of the mapping into rows. Returns 1 while some
+ * of the file is still unindexed. */
+int editorLoadChunk(size_t bytes) {
+    document *d = &E.doc;
+    const char *map = d->map;
+    size_t len = d->maplen;
+    size_t stop = len - d->load_off > bytes ? d->load_off + bytes : len;
+    size_t nl[4096];
+    while (d->load_off < stop) {
+        size_t scanned;
+        size_t n = lineIndexScan(map + d->load_off, stop - d->load_off, d->load_off, nl, 4096, &scanned);
+        for (size_t i = 0; i < n; i++) {
+            size_t end = nl[i];
+            while (end > d->load_start && map[end-1] == '\r') end--;
+            editorMarkRowDirty(E.numrows);
+            editorAppendMappedRow(map + d->load_start, end - d->load_start);
+            d->load_start = nl[i] + 1;
+        }
+        d->load_off += scanned;
+    }
+    if (d->load_off == len) {
+        if (d->load_start < len) {
+            // last line without a trailing newline
+            size_t end = len;
+            while (end > d->load_start && map[end-1] == '\r') end--;
+            editorMarkRowDirty(E.numrows);
+            editorAppendMappedRow(map + d->load_start, end - d->load_start);
+        }
+        d->loading = 0;
+        statsOpened(len);
+    }
+    return d->loading;
+}
+
+/* Index for a few milliseconds, so keys are still handled promptly */
+void editorLoadSlice() {
+    struct timespec t0, t;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    do {
+        if (!editorLoadChunk(1 << 20)) break;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+    } while ((t.tv_sec - t0.tv_sec) * 1000000000L + (t.tv_nsec - t0.tv_nsec) < 8000000L);
+}
+
+/* Finish indexing the file (before anything that needs the whole document) */
+void editorLoadAll() {
+    while (E.doc.loading) editorLoadChunk((size_t)64 << 20);
+}
+
+/* Map a regular file and split it into rows that point into the mapping:
+ * no per-line copy, so memory grows with edits rather than file size.
+ * Returns 0 if the file can't be mapped and must be read instead. */
+int editorOpenMapped(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    E.doc.map = map;
+    E.doc.maplen = E.doc.disklen = st.st_size;
+    E.doc.map_dev = st.st_dev;
+    E.doc.map_ino = st.st_ino;
+    E.doc.loading = 1;
+    E.doc.load_off = E.doc.load_start = 0;
+
+    // index just enough for the first screen; editorReadKey does the rest
+    while (E.doc.loading && E.numrows <= E.screenrows) editorLoadChunk(64 * 1024);
+    return 1;
+}
+
+void editorOpen(const char *filename) {
+    swapClose(0); // what was not saved stays recoverable
+    editorFreeRows();
+    editorInvalidateScreen();
+    stats.open_at = monotonicUs();
+    strncpy(E.filename, filename, sizeof(E.filename)-1);
+    E.filename[sizeof(E.filename)-1] = '\0';
+    editorSelectSyntax();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1 && editorOpenMapped(fd)) {
+        close(fd);
+        E.dirty = 0;
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Opened %s", filename);
+        E.statusmsg_time = time(NULL);
+        swapRecover();
+        return;
+    }
+
+    FILE *fp = fd != -1 ? fdopen(fd, "r") : NULL;
+    if (!fp) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Could not open: %s", strerror(errno));
+        E.statusmsg_time = time(NULL);
+        if (fd != -1) close(fd);
+        swapRecover(); // edits to a file that was never saved
+        return;
+    }
+
+    char *line = NULL;
+    size_t cap = 0, bytes = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        bytes += len;
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) len--;
+        editorAppendRow(line, len);
+    }
+    free(line);
+    fclose(fp);
+    statsOpened(bytes);
+    E.dirty = 0;
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Opened %s", filename);
+    E.statusmsg_time = time(NULL);
+    swapRecover();
+}
+
+/* Pager (-R).
+ * The file is mapped and never split into rows: E.doc holds just the lines
+ * on screen, borrowed from the mapping, and moving the view drops rows at
+ * one end and adds them at the other, so drawing, damage and scrolling
+ * work as for any edit and memory stays flat whatever the file size. Lines
+ * are found with memchr / memrchr from the top of the screen, so opening
+ * costs a screenful and the end is found by scanning back from EOF. Line
+ * numbers are counted while moving a line or a page at a time; after a
+ * jump they are unknown and only the position in bytes is shown. */
+struct {
+    int on;
+    size_t top;         // offset of the line at the top of the screen
+    size_t end;         // offset just past the last line in E.doc
+    long line;          // line number of top, -1 if unknown
+    char query[128];    // last search, for 'n'
+} pager;
+
+#define PAGER_LINE_MAX (1 << 20) // longer lines are cut short
+
+/* Start of the line holding the byte at off */
+size_t pagerLineStart(size_t off) {
+    const char *nl = off ? memrchr(E.doc.map, '\n', off) : NULL;
+    return nl ? (size_t)(nl - E.doc.map) + 1 : 0;
+}
+
+/* Start of the line after / before the one starting at off */
+size_t pagerNext(size_t off) {
+    const char *nl = memchr(E.doc.map + off, '\n', E.doc.maplen - off);
+    return nl ? (size_t)(nl - E.doc.map) + 1 : E.doc.maplen;
+}
+
+size_t pagerPrev(size_t off) {
+    return off ? pagerLineStart(off - 1) : 0;
+}
+
+/* Length of the line starting at off, as it is shown */
+size_t pagerLineLen(size_t off) {
+    size_t end = pagerNext(off);
+    if (end > off && E.doc.map[end-1] == '\n') end--;
+    while (end > off && E.doc.map[end-1] == '\r') end--;
+    return end - off > PAGER_LINE_MAX ? PAGER_LINE_MAX : end - off;
+}
+
+/* Make the line starting at off row 'at' of the window */
+void pagerRow(int at, size_t off) {
+    editorInsertMappedRow(at, E.doc.map + off, pagerLineLen(off));
+}
+
+/* Screen lines the line starting at off takes */
+int pagerScreenLines(size_t off) {
+    if (!E.wrap) return 1;
+    erow row;
+    memset(&row, 0, sizeof(row));
+    row.chars = E.doc.map + off;
+    row.size = row.cap = row.gap = pagerLineLen(off);
+    row.flags = ROW_MAPPED;
+    return wrapRowLines(&row);
+}
+
+/* Where the top line is when the last line of the file is at the bottom */
+size_t pagerLastTop() {
+    size_t off = E.doc.maplen;
+    int lines = 0;
+    while (off > 0) {
+        size_t prev = pagerPrev(off);
+        lines += pagerScreenLines(prev);
+        if (lines > E.screenrows && off < E.doc.maplen) break;
+        off = prev;
+    }
+    return off;
+}
+
+/* Fill the window from the line at top and repaint */
+/* Drop a row from the window. Unlike editorDelRow this is not an edit,
+ * so the document stays clean. */
+void pagerDropRow(int at) {
+    int dirty = E.dirty;
+    editorDelRow(at);
+    E.dirty = dirty;
+}
+
+void pagerShow(size_t top, long line) {
+    while (E.numrows) pagerDropRow(E.numrows - 1);
+    pager.top = top;
+    pager.line = top == 0 ? 0 : line;
+    size_t off = top;
+    while (E.numrows < E.screenrows && off < E.doc.maplen) {
+        pagerRow(E.numrows, off);
+        off = pagerNext(off);
+    }
+    pager.end = off;
+    hlInvalidate(0, 0);
+    editorInvalidateScreen();
+}
+
+/* Scroll a line; 0 once the end of the file is on screen */
+int pagerDown() {
+    if (pager.top >= pagerLastTop()) return 0;
+    pagerDropRow(0);
+    editorScreenDeleteRow(0);
+    pager.top = pagerNext(pager.top);
+    if (pager.line >= 0) pager.line++;
+    if (pager.end < E.doc.maplen) {
+        editorMarkRowDirty(E.numrows);
+        pagerRow(E.numrows, pager.end);
+        pager.end = pagerNext(pager.end);
+    }
+    return 1;
+}
+
+int pagerUp() {
+    if (pager.top == 0) return 0;
+    if (E.numrows == E.screenrows) {
+        // the bottom line scrolls off
+        pagerDropRow(E.numrows - 1);
+        pager.end = pagerPrev(pager.end);
+    }
+    pager.top = pagerPrev(pager.top);
+    if (pager.line > 0) pager.line--;
+    if (pager.top == 0) pager.line = 0;
+    pagerRow(0, pager.top);
+    editorScreenInsertRow(0);
+    return 1;
+}
+
+/* Move the view n lines down (up for n < 0), never past the last screenful.
+ * Short moves scroll what is on the terminal; long ones repaint. */
+void pagerMove(long n) {
+    if (n < E.screenrows / 2 && -n < E.screenrows / 2) {
+        while (n > 0 && pagerDown()) n--;
+        while (n < 0 && pagerUp()) n++;
+        return;
+    }
+    size_t off = pager.top;
+    long moved = 0;
+    if (n > 0) {
+        size_t last = pagerLastTop();
+        while (moved < n && off < last) { off = pagerNext(off); moved++; }
+    } else {
+        while (moved > n && off > 0) { off = pagerPrev(off); moved--; }
+    }
+    if (moved) pagerShow(off, pager.line >= 0 ? pager.line + moved : -1);
+}
+
+/* Show the next line after the top one that contains the query */
+void pagerFind() {
+    if (pager.query[0] == '\0') return;
+    size_t from = pagerNext(pager.top);
+    const char *hit = from < E.doc.maplen ?
+        memmem(E.doc.map + from, E.doc.maplen - from, pager.query, strlen(pager.query)) : NULL;
+    if (hit == NULL) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Not found: %.60s", pager.query);
+        E.statusmsg_time = time(NULL);
+        return;
+    }
+    pagerShow(pagerLineStart(hit - E.doc.map), -1);
+}
+
+/* View filename read-only. Returns 0 (with errno set) if it can't be mapped. */
+int pagerOpen(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = ENODEV;
+        return 0;
+    }
+    char *map = NULL;
+    if (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    strncpy(E.filename, filename, sizeof(E.filename)-1);
+    E.filename[sizeof(E.filename)-1] = '\0';
+    editorSelectSyntax();
+    E.doc.map = map;
+    E.doc.maplen = E.doc.disklen = st.st_size;
+    E.doc.map_dev = st.st_dev;
+    E.doc.map_ino = st.st_ino;
+    pager.on = 1;
+    pagerShow(0, 0);
+    return 1;
+}
+
+void pagerProcessKey(int c) {
+    switch (c) {
+        case 'F': case 'f' | KEY_ALT: { // follow, as in less: from the end
+            if (follow.on) {
+                followStop();
+                break;
+            }
+            followStart();
+            size_t last = pagerLastTop();
+            if (last > pager.top) pagerShow(last, -1);
+            break; }
+        case '\x04': // Ctrl-D as in the editor
+            E.debug = (E.debug + 1) % 3;
+            break;
+        case 's' | KEY_ALT:
+            editorToggleWrap();
+            break;
+        case 'q': case 'Q': case '\x18':
+            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(STDOUT_FILENO, "\x1b[H", 3);
+            exit(0);
+            break;
+        case ARROW_DOWN: case '\r': case 'j':
+            pagerMove(1);
+            break;
+        case ARROW_UP: case 'k':
+            pagerMove(-1);
+            break;
+        case PAGE_DOWN: case ' ': case 'f':
+            pagerMove(E.screenrows);
+            break;
+        case PAGE_UP: case 'b':
+            pagerMove(-E.screenrows);
+            break;
+        case HOME_KEY: case HOME_KEY | KEY_CTRL: case 'g': case '<':
+            if (pager.top) pagerShow(0, 0);
+            break;
+        case END_KEY: case END_KEY | KEY_CTRL: case 'G': case '>': {
+            size_t last = pagerLastTop();
+            if (last > pager.top) pagerShow(last, -1);
+            break; }
+        case ARROW_RIGHT:
+            if (!E.wrap) E.coloff += E.screencols / 2;
+            break;
+        case ARROW_LEFT:
+            E.coloff = E.coloff > E.screencols / 2 ? E.coloff - E.screencols / 2 : 0;
+            break;
+        case '/': case '\x17': { // search forward, as in less / the editor
+            char *q = editorPrompt("Search forward: ", NULL);
+            if (q == NULL) break;
+            if (q[0]) snprintf(pager.query, sizeof(pager.query), "%s", q);
+            free(q);
+            pagerFind();
+            break; }
+        case 'n':
+            pagerFind();
+            break;
+        case MOUSE_EVENT:
+            if (!mouse.release && (mouse.button == 64 || mouse.button == 65))
+                pagerMove(mouse.button == 64 ? -3 : 3);
+            break;
+        default:
+            if (c == KEY_PASTE) { // drop it
+                int len;
+                free(editorReadPaste(&len));
+            }
+            snprintf(E.statusmsg, sizeof(E.statusmsg), "Read-only | q: Quit | /: Search | g / G: Start / End");
+            E.statusmsg_time = time(NULL);
+            break;
+    }
+}
+
+/* Follow mode (Alt-F).
+ * Like tail -f: what is appended to the file is split by the line indexer
+ * into rows added at the end of the document, and a cursor on the last line
+ * stays on it, so the view scrolls along. A line written in pieces grows
+ * in its row. If the file is truncated or replaced (log rotation), an
+ * unmodified document is reloaded from the new one. The pager remaps the
+ * longer file and refills its window instead. */
+
+/* Follow the file from where the document was read up to: the end of the
+ * mapping (or of the last in-place save), if it is of this file, or else the
+ * end of the file as it is now */
+void followStart() {
+    followStop();
+    if (E.filename[0] == '\0') return;
+    int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Can't follow: %s", strerror(errno));
+        E.statusmsg_time = time(NULL);
+        if (fd != -1) close(fd);
+        return;
+    }
+    follow.fd = fd;
+    follow.dev = st.st_dev;
+    follow.ino = st.st_ino;
+    int mapped = E.doc.map && st.st_dev == E.doc.map_dev && st.st_ino == E.doc.map_ino;
+    follow.off = mapped ? E.doc.disklen : (size_t)st.st_size;
+    char c;
+    follow.partial = !pager.on && follow.off > 0 && E.numrows > 0 &&
+                     pread(fd, &c, 1, follow.off - 1) == 1 && c != '\n';
+#ifdef __linux__
+    follow.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow.ifd != -1 &&
+        inotify_add_watch(follow.ifd, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+        close(follow.ifd);
+        follow.ifd = -1;
+    }
+#endif
+    follow.on = 1;
+    follow.last = 0;
+    follow.due = monotonicMs(); // pick up what was written since the file was read
+}
+
+void followStop() {
+    if (follow.fd != -1) close(follow.fd);
+    if (follow.ifd != -1) close(follow.ifd);
+    follow.fd = follow.ifd = -1;
+    follow.on = 0;
+    follow.due = 0;
+}
+
+/* Add one line (or the start of one, if !complete) at the end */
+void followLine(const char *s, size_t len, int complete) {
+    if (complete) while (len > 0 && s[len-1] == '\r') len--;
+    if (follow.partial) {
+        erow *row = editorRow(E.numrows - 1);
+        rowInsert(&E.doc.mem, row, row->size, s, len);
+        editorMarkRowDirty(E.numrows - 1);
+    } else {
+        editorMarkRowDirty(E.numrows);
+        editorInsertRow(E.numrows, s, len);
+    }
+    follow.partial = !complete;
+}
+
+/* Read up to FOLLOW_SLICE appended bytes into rows. Returns 1 if there is more. */
+int followRows(size_t size) {
+    static char *buf;
+    if (buf == NULL && (buf = malloc(FOLLOW_SLICE)) == NULL) die("malloc");
+    size_t want = size - follow.off < FOLLOW_SLICE ? size - follow.off : FOLLOW_SLICE;
+    ssize_t n = pread(follow.fd, buf, want, follow.off);
+    if (n <= 0) return 0;
+
+    int pinned = E.cy >= E.numrows - 1, past = E.cy == E.numrows;
+    int dirty = E.dirty;
+    size_t nl[4096];
+    size_t start = 0, off = 0;
+    while (off < (size_t)n) {
+        size_t scanned;
+        size_t k = lineIndexScan(buf + off, n - off, off, nl, 4096, &scanned);
+        for (size_t i = 0; i < k; i++) {
+            followLine(buf + start, nl[i] - start, 1);
+            start = nl[i] + 1;
+        }
+        off += scanned;
+    }
+    if (start < (size_t)n) followLine(buf + start, n - start, 0);
+    follow.off += n;
+    E.dirty = dirty; // the file has these lines too
+    if (pinned) {
+        E.cy = past ? E.numrows : E.numrows - 1;
+        editorClampCursor();
+    }
+    return follow.off < size;
+}
+
+/* The pager's window points into the mapping: map the longer file and
+ * refill it, keeping the bottom in view if it was */
+void followPager(size_t size) {
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, follow.fd, 0);
+    if (map == MAP_FAILED) return;
+    int pinned = pager.top >= pagerLastTop();
+    while (E.numrows) pagerDropRow(E.numrows - 1);
+    if (E.doc.map) munmap(E.doc.map, E.doc.maplen);
+    E.doc.map = map;
+    E.doc.maplen = E.doc.disklen = size;
+    follow.off = size;
+    size_t top = pager.top;
+    long line = pager.line;
+    if (pinned) {
+        size_t last = pagerLastTop();
+        for (; line >= 0 && top < last; top = pagerNext(top)) line++;
+        top = last;
+    }
+    pagerShow(top, line);
+}
+
+/* The file was truncated or replaced: start over with what is there now */
+void followReopen() {
+    char name[sizeof(E.filename)];
+    snprintf(name, sizeof(name), "%s", E.filename);
+    followStop();
+    if (E.dirty && !pager.on) { // the pager has no edits to lose
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "%.40s changed on disk; stopped following", name);
+        E.statusmsg_time = time(NULL);
+        return;
+    }
+    if (pager.on) {
+        editorFreeRows();
+        if (!pagerOpen(name)) {
+            snprintf(E.statusmsg, sizeof(E.statusmsg), "Can't reopen: %s", strerror(errno));
+            E.statusmsg_time = time(NULL);
+            return;
+        }
+        pagerShow(pagerLastTop(), -1);
+    } else {
+        editorOpen(name);
+        E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        E.cx = E.rowoff = E.coloff = 0;
+    }
+    followStart();
+}
+
+/* Check the file for changes and take in what was appended */
+void followTick() {
+    long long now = monotonicMs();
+    follow.due = 0;
+    follow.last = now;
+    if (E.doc.loading) {
+        // the indexer is still on the bytes that were there at open
+        follow.due = now + FOLLOW_INTERVAL;
+        return;
+    }
+    struct stat st, path;
+    if (fstat(follow.fd, &st) == -1) return;
+    int replaced = stat(E.filename, &path) == -1 || path.st_dev != follow.dev || path.st_ino != follow.ino;
+    if ((size_t)st.st_size < follow.off || (replaced && (size_t)st.st_size == follow.off)) {
+        // truncated, or replaced and the old file read to its end
+        if (replaced && stat(E.filename, &path) == -1) {
+            follow.due = now + FOLLOW_POLL; // rotated, the new file is not there yet
+            return;
+        }
+        followReopen();
+        return;
+    }
+    int more = 0;
+    if ((size_t)st.st_size > follow.off) {
+        if (pager.on) followPager(st.st_size);
+        else more = followRows(st.st_size);
+    }
+    if (more) follow.due = now + FOLLOW_INTERVAL;
+    else if (follow.ifd == -1 || replaced) follow.due = now + FOLLOW_POLL;
+}
+
+/* Buffers.
+ * E holds the open file that is on screen: its document, cursor and view.
+ * The other open files are parked in buffers.b[] just as they were, with
+ * their mapping, undo history, lexer states and journal, so switching is a
+ * struct swap: nothing is re-read or re-split. When the parked buffers hold
+ * more than BUFFER_BUDGET, the least recently used unmodified ones are
+ * dropped down to their name and position and reopened when switched to. */
+#define MAX_BUFFERS 16
+#ifndef BUFFER_BUDGET
+#define BUFFER_BUDGET ((size_t)256 << 20)
+#endif
+
+typedef struct editorBuffer {
+    document doc;
+    int numrows, dirty;
+    int cx, cy, rowoff, coloff, segoff;
+    struct editorSyntax *syntax;
+    char filename[512];
+    struct swapJournal swap;
+    int evicted;            // only the name and position are left
+    unsigned long used;     // when it was last on screen, for LRU eviction
+} editorBuffer;
+
+struct {
+    editorBuffer b[MAX_BUFFERS];    // b[cur] is unused: E holds that one
+    int n, cur;
+    unsigned long clock;
+} buffers = {.n = 1};
+
+static const struct swapJournal swapClosed = {-1, 0, "", 0, ABUF_INIT, 0, {0, 0}};
+
+/* Park the active file in b and leave E empty */
+void bufferStash(editorBuffer *b) {
+    followStop(); // only the file on screen is followed
+    compactAbort();
+    editorSaveCollect(1); // a save in flight reads these rows and rebases this journal
+    swapFlush();
+    b->doc = E.doc;
+    b->numrows = E.numrows;
+    b->dirty = E.dirty;
+    b->cx = E.cx; b->cy = E.cy;
+    b->rowoff = E.rowoff; b->coloff = E.coloff; b->segoff = E.segoff;
+    b->syntax = E.syntax;
+    memcpy(b->filename, E.filename, sizeof(b->filename));
+    b->swap = swap;
+    b->evicted = 0;
+    b->used = ++buffers.clock;
+
+    docInit(&E.doc);
+    E.numrows = E.dirty = 0;
+    E.cx = E.cy = E.rowoff = E.coloff = E.segoff = 0;
+    E.syntax = NULL;
+    E.filename[0] = '\0';
+    swap = swapClosed;
+}
+
+/* Put b on screen; E must be empty (just stashed or closed) */
+void bufferRestore(editorBuffer *b) {
+    E.cx = b->cx; E.cy = b->cy;
+    E.rowoff = b->rowoff; E.coloff = b->coloff; E.segoff = b->segoff;
+    if (b->evicted) {
+        editorOpen(b->filename);
+        // index as far as the old position rather than the first screen
+        while (E.doc.loading && E.numrows <= (E.cy > E.rowoff ? E.cy : E.rowoff) + E.screenrows)
+            editorLoadChunk(1 << 20);
+        if (E.rowoff > E.numrows) E.rowoff = E.numrows;
+        editorClampCursor();
+    } else {
+        docFree(&E.doc);
+        E.doc = b->doc;
+        E.numrows = b->numrows;
+        E.dirty = b->dirty;
+        E.syntax = b->syntax;
+        memcpy(E.filename, b->filename, sizeof(E.filename));
+        swap = b->swap;
+        if (E.wrap) docNodeStaleAll(E.doc.root); // the width may have changed meanwhile
+    }
+    editorInvalidateScreen();
+}
+
+size_t bufferFootprint(editorBuffer *b) {
+    return b->doc.mem.reserved + (size_t)b->numrows * sizeof(erow);
+}
+
+/* Drop the least recently used unmodified buffers while the parked ones
+ * hold more than BUFFER_BUDGET */
+void bufferEvict() {
+    while (1) {
+        size_t total = 0;
+        int lru = -1;
+        for (int i = 0; i < buffers.n; i++) {
+            editorBuffer *b = &buffers.b[i];
+            if (i == buffers.cur || b->evicted) continue;
+            total += bufferFootprint(b);
+            if (!b->dirty && (lru == -1 || b->used < buffers.b[lru].used)) lru = i;
+        }
+        if (total <= BUFFER_BUDGET || lru == -1) return;
+        editorBuffer *b = &buffers.b[lru];
+        docFree(&b->doc);
+        if (b->swap.fd != -1) {
+            close(b->swap.fd); // unmodified: nothing in it to recover
+            unlink(b->swap.path);
+        }
+        free(b->swap.pending.b);
+        b->swap = swapClosed;
+        b->evicted = 1;
+    }
+}
+
+void editorBufferMessage() {
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "[%d/%d] %.50s", buffers.cur + 1, buffers.n,
+             E.filename[0] ? E.filename : "[No Name]");
+    E.statusmsg_time = time(NULL);
+}
+
+void editorSwitchBuffer(int i) {
+    if (i != buffers.cur) {
+        bufferStash(&buffers.b[buffers.cur]);
+        buffers.cur = i;
+        bufferRestore(&buffers.b[i]);
+        bufferEvict();
+    }
+    editorBufferMessage();
+}
+
+/* Ctrl-O: go to the file if it is open, else open it in a new buffer (or
+ * in this one, if it is empty and has no name) */
+void editorOpenBuffer(const char *filename) {
+    if (strcmp(E.filename, filename) == 0) {
+        editorBufferMessage();
+        return;
+    }
+    for (int i = 0; i < buffers.n; i++) {
+        if (i != buffers.cur && strcmp(buffers.b[i].filename, filename) == 0) {
+            editorSwitchBuffer(i);
+            return;
+        }
+    }
+    if (E.filename[0] || E.dirty || E.numrows) {
+        if (buffers.n == MAX_BUFFERS) {
+            snprintf(E.statusmsg, sizeof(E.statusmsg), "Too many open files");
+            E.statusmsg_time = time(NULL);
+            return;
+        }
+        bufferStash(&buffers.b[buffers.cur]);
+        buffers.cur = buffers.n++;
+    }
+    editorOpen(filename);
+    bufferEvict();
+}
+
+/* Ctrl-X with other files open: close this one (already saved or given
+ * up) and go back to the one used most recently */
+void editorCloseBuffer() {
+    editorFreeRows();
+    int next = -1;
+    for (int i = 0; i < buffers.n; i++)
+        if (i != buffers.cur && (next == -1 || buffers.b[i].used > buffers.b[next].used)) next = i;
+    memmove(&buffers.b[buffers.cur], &buffers.b[buffers.cur + 1],
+            sizeof(editorBuffer) * (buffers.n - buffers.cur - 1));
+    buffers.n--;
+    if (next > buffers.cur) next--;
+    buffers.cur = next;
+    bufferRestore(&buffers.b[next]);
+    editorBufferMessage();
+}
+
+/* Saving runs on a background thread. editorSave takes a snapshot: a list
+ * of iovecs pointing straight at row text, where a piece that starts where
+ * the previous one ended (consecutive lines of the mapping) extends it. The
+ * rows it references are marked ROW_SHARED and the arena is pinned until
+ * the write is collected, so a shared row is copied before its first edit
+ * and freed buffers are held back: the snapshot never changes under the
+ * writer.
+ * With MINI_NANO_INPLACE set, a big file saved over itself is rewritten in
+ * place instead: rows still mapped at the offset they are saved to, or
+ * whose text equals what the file has there, are skipped, and only the runs
+ * between them are written. Mapped rows that would move are copied out
+ * first, since the writes show through the mapping. */
+#ifndef SAVE_INPLACE_MIN
+#define SAVE_INPLACE_MIN (1 << 20)      // smaller files are always replaced
+#endif
+#define SAVE_MOVE_MAX ((size_t)64 << 20) // mapped text copied out to save in place
+
+struct saveRun {
+    off_t off;          // where in the file...
+    int iov;            // ...the iovecs from this one on go
+};
+
+struct saveJob {
+    struct iovec *iov;
+    int niov, cap;
+    int inplace;        // write the runs into the file itself
+    struct saveRun *runs;
+    int nruns, runcap;
+    off_t pos;          // file offset after the last byte queued or skipped
+    off_t runend;       // file offset the last run has reached
+    size_t moved;       // mapped text copied out for this save
+    char filename[512];
+    const char *what;   // step that failed
+    int err;            // its errno, 0 on success
+    int running;        // started and not collected yet
+    int joinable;
+    off_t swapoff;      // journal length when the snapshot was taken
+    atomic_int done;
+    pthread_t thread;
+} S;
+
+void saveQueue(const char *p, size_t len) {
+    if (len == 0) return;
+    if (S.inplace && (S.nruns == 0 || S.runend != S.pos)) {
+        // something was skipped: the next bytes start a run of their own
+        if (S.nruns == S.runcap) {
+            S.runcap = S.runcap ? S.runcap * 2 : 64;
+            S.runs = realloc(S.runs, sizeof(struct saveRun) * S.runcap);
+            if (S.runs == NULL) die("realloc");
+        }
+        S.runs[S.nruns].off = S.pos;
+        S.runs[S.nruns].iov = S.niov;
+        S.nruns++;
+    }
+    S.pos += len;
+    S.runend = S.pos;
+    if (S.niov > (S.inplace ? S.runs[S.nruns - 1].iov : 0)) {
+        struct iovec *last = &S.iov[S.niov - 1];
+        if ((const char *)last->iov_base + last->iov_len == p) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (S.niov == S.cap) {
+        S.cap = S.cap ? S.cap * 2 : 1024;
+        S.iov = realloc(S.iov, sizeof(struct iovec) * S.cap);
+        if (S.iov == NULL) die("realloc");
+    }
+    S.iov[S.niov].iov_base = (void *)p;
+    S.iov[S.niov].iov_len = len;
+    S.niov++;
+}
+
+/* writev the whole list, IOV_MAX entries at a time */
+int ioWriteAll(int fd, struct iovec *v, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, v, n < IOV_MAX ? n : IOV_MAX);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // skip what was written, possibly ending inside an iovec
+        while (n > 0 && (size_t)w >= v->iov_len) { w -= v->iov_len; v++; n--; }
+        if (n > 0) {
+            v->iov_base = (char *)v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/* pwritev the list at 'off', IOV_MAX entries at a time */
+int ioPwriteAll(int fd, struct iovec *v, int n, off_t off) {
+    while (n > 0) {
+        ssize_t w = pwritev(fd, v, n < IOV_MAX ? n : IOV_MAX, off);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += w;
+        while (n > 0 && (size_t)w >= v->iov_len) { w -= v->iov_len; v++; n--; }
+        if (n > 0) {
+            v->iov_base = (char *)v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+void saveDone(struct saveJob *j, long long t0) {
+    size_t bytes = 0;
+    for (int i = 0; i < j->niov; i++) bytes += j->iov[i].iov_len;
+    statAdd(&stats.saves, 1);
+    statAdd(&stats.save_bytes, bytes);
+    statAdd(&stats.save_us, monotonicUs() - t0);
+}
+
+/* Write the changed runs over the file, cut it to the new length and fsync
+ * it. This gives up the atomic replace: a crash half way leaves a mix of old
+ * and new text that nothing can repair, so it is only done on request. */
+void saveInPlace(struct saveJob *j, long long t0) {
+    int fd = open(j->filename, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        j->what = "Can't save";
+        j->err = errno;
+        return;
+    }
+    int r = 0;
+    for (; r < j->nruns; r++) {
+        int end = r + 1 < j->nruns ? j->runs[r + 1].iov : j->niov;
+        if (ioPwriteAll(fd, j->iov + j->runs[r].iov, end - j->runs[r].iov, j->runs[r].off) == -1) break;
+    }
+    if (r < j->nruns || ftruncate(fd, j->pos) == -1 || fsync(fd) == -1) {
+        j->what = "Write error";
+        j->err = errno;
+    } else {
+        saveDone(j, t0);
+    }
+    close(fd);
+}
+
+/* Write the snapshot to a temporary file next to the target, fsync it and
+ * rename it into place, so the old contents survive until the new ones are
+ * complete. Rows mapped from the old file stay valid: the mapping keeps the
+ * replaced inode alive. */
+void saveReplace(struct saveJob *j, long long t0) {
+    // replace the file a symlink points to, not the link
+    char target[PATH_MAX];
+    if (realpath(j->filename, target) == NULL) snprintf(target, sizeof(target), "%s", j->filename);
+
+    char tmpname[PATH_MAX + 16];
+    const char *slash = strrchr(target, '/');
+    if (slash)
+        snprintf(tmpname, sizeof(tmpname), "%.*s.%s.XXXXXX", (int)(slash - target + 1), target, slash + 1);
+    else
+        snprintf(tmpname, sizeof(tmpname), ".%s.XXXXXX", target);
+
+    int fd = mkstemp(tmpname);
+    if (fd == -1) {
+        j->what = "Can't save";
+        j->err = errno;
+    } else {
+        struct stat st;
+        fchmod(fd, stat(target, &st) == 0 ? (st.st_mode & 07777) : 0644);
+        if (ioWriteAll(fd, j->iov, j->niov) == -1 || fsync(fd) == -1) {
+            j->what = "Write error";
+            j->err = errno;
+            close(fd);
+            unlink(tmpname);
+        } else if (close(fd), rename(tmpname, target) == -1) {
+            j->what = "Can't save";
+            j->err = errno;
+            unlink(tmpname);
+        } else {
+            // make the rename itself durable
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - target + 1) : 1, slash ? target : ".");
+            int dfd = open(dir, O_RDONLY);
+            if (dfd != -1) { fsync(dfd); close(dfd); }
+            saveDone(j, t0);
+        }
+    }
+}
+
+void *saveWorker(void *arg) {
+    struct saveJob *j = arg;
+    j->err = 0;
+    long long t0 = monotonicUs();
+    if (j->inplace) saveInPlace(j, t0);
+    else saveReplace(j, t0);
+    atomic_store(&j->done, 1);
+    if (write(E.savepipe[1], "", 1) == -1) {} // wakes editorReadKey
+    return NULL;
+}
+
+/* Collect a finished save, or with 'wait' block for the running one.
+ * Returns 0 if none was collected, 1 if it succeeded, -1 if it failed. */
+int editorSaveCollect(int wait) {
+    if (!S.running || (!wait && !atomic_load(&S.done))) return 0;
+    if (S.joinable) pthread_join(S.thread, NULL);
+    S.running = 0;
+    size_t written = 0;
+    for (int i = 0; i < S.niov; i++) written += S.iov[i].iov_len;
+    S.niov = 0;
+    arenaUnpin(&E.doc.mem);
+    if (S.inplace) {
+        // the file holds the rows now, up to the new length; a failed write
+        // may leave it shorter than before, but never longer than that
+        if (!S.err || E.doc.disklen > (size_t)S.pos) E.doc.disklen = S.pos;
+    }
+    if (S.err) {
+        E.dirty = 1;
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "%s: %s", S.what, strerror(S.err));
+        E.statusmsg_time = time(NULL);
+        return -1;
+    }
+    if (strcmp(S.filename, E.filename) == 0) {
+        swapRebase(S.swapoff);
+        if (follow.on) followStart(); // the name is a new file now: follow that
+    }
+    if (S.inplace) {
+        char w[16];
+        editorFormatBytes(w, sizeof(w), written);
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Saved to %.30s (%s rewritten in place)", S.filename, w);
+    } else {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Saved to %.60s", S.filename);
+    }
+    E.statusmsg_time = time(NULL);
+    return 1;
+}
+
+/* Can the save go over the mapped file itself? Only if the user accepts
+ * non-atomic saves and it is still the file that was mapped, at least as
+ * long as the part of the mapping in use. */
+int saveCanInPlace(const char *filename) {
+    struct stat st;
+    size_t valid = E.doc.maplen < E.doc.disklen ? E.doc.maplen : E.doc.disklen;
+    return getenv("MINI_NANO_INPLACE") && E.doc.map && valid >= SAVE_INPLACE_MIN && stat(filename, &st) == 0 && S_ISREG(st.st_mode) &&
+           st.st_dev == E.doc.map_dev && st.st_ino == E.doc.map_ino && (size_t)st.st_size >= valid;
+}
+
+/* Does the file already have this row and its newline at 'off'? */
+int saveUnchanged(erow *row, size_t off, size_t valid) {
+    const char *m = E.doc.map + off;
+    if (off + row->size >= valid || m[row->size] != '\n') return 0;
+    if (row->flags & ROW_MAPPED) return row->chars == m;
+    return row->size == 0 || (memcmp(row->chars, m, row->gap) == 0 &&
+                              memcmp(rowTail(row), m + row->gap, row->size - row->gap) == 0);
+}
+
+/* Snapshot the document and start writing it out. The result shows up in
+ * the status message once editorSaveCollect picks it up. */
+int editorSave(const char *filename) {
+    if (filename == NULL || filename[0] == '\0') filename = E.filename[0] ? E.filename : NULL;
+    if (!filename) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "No filename");
+        E.statusmsg_time = time(NULL);
+        return 0;
+    }
+    editorSaveCollect(0);
+    if (S.running) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Still saving, try again");
+        E.statusmsg_time = time(NULL);
+        return 0;
+    }
+
+    editorLoadAll();
+
+    static const char newline = '\n';
+    size_t valid = E.doc.maplen < E.doc.disklen ? E.doc.maplen : E.doc.disklen;
+    S.niov = S.nruns = 0;
+    S.pos = S.runend = 0;
+    S.moved = 0;
+    S.inplace = saveCanInPlace(filename);
+    for (int i = 0; i < E.numrows; i++) {
+        erow *row = editorRow(i);
+        const char *nl = &newline;
+        if (S.inplace) {
+            if (saveUnchanged(row, S.pos, valid)) {
+                S.pos += row->size + 1;
+                continue;
+            }
+            if (row->flags & ROW_MAPPED) {
+                // it moves: writing its new place may overwrite the old one
+                S.moved += row->size;
+                if (S.moved > SAVE_MOVE_MAX) {
+                    // too much has moved: replace the whole file after all
+                    S.inplace = 0;
+                    S.niov = S.nruns = 0;
+                    S.pos = S.runend = 0;
+                    i = -1;
+                    continue;
+                }
+                rowUnmap(&E.doc.mem, row, 0);
+            }
+        }
+        if (row->flags & ROW_MAPPED) {
+            // a mapped row is usually followed by its own '\n' in the mapping
+            if (row->chars + row->size < E.doc.map + valid && row->chars[row->size] == '\n')
+                nl = row->chars + row->size;
+        } else if (row->chars) {
+            row->flags |= ROW_SHARED;
+        }
+        saveQueue(row->chars, row->gap);
+        saveQueue(rowTail(row), row->size - row->gap);
+        saveQueue(nl, 1);
+    }
+    E.doc.mem.pinned = 1;
+    S.swapoff = swapLength();
+
+    snprintf(S.filename, sizeof(S.filename), "%s", filename);
+    atomic_store(&S.done, 0);
+    S.running = 1;
+    S.joinable = pthread_create(&S.thread, NULL, saveWorker, &S) == 0;
+    if (!S.joinable) saveWorker(&S); // no thread: save in the foreground
+
+    E.dirty = 0; // edits made while the save runs set it again
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Saving %.60s...", filename);
+    E.statusmsg_time = time(NULL);
+    return 1;
+}
+
+/* Editor operations: insertion, deletion, newline */
+void editorInsertChar(int c) {
+    undoTyped(E.cy, E.cx, c);
+    if (E.cy == E.numrows) {
+        // append empty row
+        editorAppendRow("", 0);
+    }
+    char ch = c;
+    rowInsert(&E.doc.mem, editorRow(E.cy), E.cx, &ch, 1);
+    editorMarkRowDirty(E.cy);
+    E.cx++;
+    E.dirty = 1;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+    erow *row = editorRow(E.cy);
+    if (E.cx > 0) {
+        // the whole UTF-8 character before the cursor
+        int from = E.cx - 1;
+        while (rowIsCont(row, from)) from--;
+        char ch[4];
+        int n = E.cx - from < 4 ? E.cx - from : 4;
+        from = E.cx - n;
+        rowCopy(row, from, n, ch);
+        // a run of Backspace / Delete on one line is one undo step
+        undorec *last = undoLast();
+        undoLog(UNDO_DELETE, E.cy, from, ch, n,
+                last && last->type == UNDO_DELETE && last->row == E.cy &&
+                (last->col == E.cx || last->col == from));
+        rowDelete(&E.doc.mem, row, from, n);
+        editorMarkRowDirty(E.cy);
+        E.cx = from;
+        E.dirty = 1;
+    } else {
+        // join line with previous
+        erow *prev = editorRow(E.cy - 1);
+        row = editorRow(E.cy);
+        int prev_size = prev->size;
+        undoLog(UNDO_DELETE, E.cy - 1, prev_size, "\n", 1, 0);
+        rowAppendRow(&E.doc.mem, prev, row, 0);
+        editorDelRow(E.cy);
+        editorScreenDeleteRow(E.cy);
+        editorMarkRowDirty(E.cy - 1);
+        E.cy--;
+        E.cx = prev_size;
+        E.dirty = 1;
+    }
+}
+
+void editorInsertNewline() {
+    if (E.cy == E.numrows) undoLog(UNDO_INSERT, E.cy, 0, "", 0, 0);
+    else undoLog(UNDO_INSERT, E.cy, E.cx, "\n", 1, 0);
+    if (E.cy == E.numrows) {
+        editorAppendRow("", 0);
+        editorMarkRowDirty(E.cy);
+    } else if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+        editorScreenInsertRow(E.cy);
+    } else {
+        int newlen = editorRow(E.cy)->size - E.cx;
+        erow *next = editorInsertRow(E.cy + 1, "", 0);
+        erow *row = editorRow(E.cy); // the insert may have moved it
+        rowReserve(&E.doc.mem, next, newlen);
+        rowCopy(row, E.cx, newlen, next->chars);
+        next->gap = next->size = newlen;
+        rowDelete(&E.doc.mem, row, E.cx, newlen);
+        editorMarkRowDirty(E.cy);
+        editorScreenInsertRow(E.cy + 1);
+    }
+    E.cy++;
+    E.cx = 0;
+    E.dirty = 1;
+}
+
+/* Insert text that may span several lines in one pass: the first line goes
+ * into the current row, the others become new rows, and what followed the
+ * cursor ends up after the last one. */
+void editorInsertText(const char *s, int len) {
+    if (E.cy == E.numrows) {
+        editorAppendRow("", 0);
+        editorMarkRowDirty(E.cy);
+    }
+    const char *end = s + len;
+    const char *nl = memchr(s, '\n', len);
+    erow *row = editorRow(E.cy);
+    if (nl == NULL) {
+        rowInsert(&E.doc.mem, row, E.cx, s, len);
+        editorMarkRowDirty(E.cy);
+        E.cx += len;
+        E.dirty = 1;
+        return;
+    }
+
+    int taillen = row->size - E.cx;
+    char *tail = malloc(taillen ? taillen : 1);
+    if (tail == NULL) die("malloc");
+    rowCopy(row, E.cx, taillen, tail);
+    rowDelete(&E.doc.mem, row, E.cx, taillen);
+    rowInsert(&E.doc.mem, row, E.cx, s, nl - s);
+    editorMarkRowDirty(E.cy);
+
+    int at = E.cy + 1;
+    const char *p = nl + 1;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        editorInsertRow(at, p, nl - p);
+        editorScreenInsertRow(at++);
+        p = nl + 1;
+    }
+    erow *last = editorInsertRow(at, p, end - p);
+    editorScreenInsertRow(at);
+    rowInsert(&E.doc.mem, last, last->size, tail, taillen);
+    free(tail);
+    E.cy = at;
+    E.cx = end - p;
+    E.dirty = 1;
+}
+
+/* Delete len bytes of text at (row, col), where a '\n' joins a line with
+ * the next one: the inverse of editorInsertText */
+void editorDeleteText(int row, int col, int len) {
+    erow *r = editorRow(row);
+    int n = r->size - col;
+    if (len <= n) {
+        rowDelete(&E.doc.mem, r, col, len);
+        editorMarkRowDirty(row);
+        E.dirty = 1;
+        return;
+    }
+    rowDelete(&E.doc.mem, r, col, n);
+    len -= n + 1;
+    // whole lines go; what is left of the last one joins this line
+    while (row + 1 < E.numrows && len > editorRow(row + 1)->size) {
+        len -= editorRow(row + 1)->size + 1;
+        editorDelRow(row + 1);
+        editorScreenDeleteRow(row + 1);
+    }
+    if (row + 1 < E.numrows) {
+        rowAppendRow(&E.doc.mem, editorRow(row), editorRow(row + 1), len);
+        editorDelRow(row + 1);
+        editorScreenDeleteRow(row + 1);
+    }
+    editorMarkRowDirty(row);
+    E.dirty = 1;
+}
+
+/* Undo and redo.
+ * Undoing an insert deletes its text and undoing a delete inserts it
+ * back; the cursor ends up where the change was. */
+void editorApplyEdit(int type, int newrow, int row, int col, const char *s, int len) {
+    if (type == UNDO_INSERT) {
+        if (newrow) {
+            editorInsertRow(row, "", 0);
+            editorScreenInsertRow(row);
+        }
+        E.cy = row;
+        E.cx = col;
+        editorInsertText(s, len);
+    } else {
+        editorDeleteText(row, col, len);
+        if (newrow) {
+            editorDelRow(row);
+            editorScreenDeleteRow(row);
+        }
+        E.cy = row;
+        E.cx = col;
+    }
+}
+
+void undoApply(undorec *r, int redo) {
+    int type = (r->type == UNDO_INSERT) == redo ? UNDO_INSERT : UNDO_DELETE;
+    swapAppend(type, r->newrow, r->row, r->col, undoText(r), r->len);
+    editorApplyEdit(type, r->newrow, r->row, r->col, undoText(r), r->len);
+}
+
+void editorUndo() {
+    undolog *u = &E.doc.undo;
+    undorec *r = undoBack(u, 0);
+    if (r == NULL) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Nothing to undo");
+        E.statusmsg_time = time(NULL);
+        return;
+    }
+    unsigned group = r->group;
+    while ((r = undoBack(u, 0)) && r->group == group) undoApply(undoBack(u, 1), 0);
+}
+
+void editorRedo() {
+    undolog *u = &E.doc.undo;
+    undorec *r = undoForward(u, 0);
+    if (r == NULL) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Nothing to redo");
+        E.statusmsg_time = time(NULL);
+        return;
+    }
+    unsigned group = r->group;
+    while ((r = undoForward(u, 0)) && r->group == group) undoApply(undoForward(u, 1), 1);
+}
+
+/* Read a bracketed paste up to its closing \x1b[201~. Line breaks become
+ * '\n' and other control characters are dropped. Returns a malloc'd
+ * buffer of *len bytes. */
+char *editorReadPaste(int *len) {
+    struct abuf ab = ABUF_INIT;
+    char c;
+    while (editorReadByte(&c, -1)) {
+        abAppend(&ab, &c, 1);
+        if (c == '~' && ab.len >= 6 && memcmp(ab.b + ab.len - 6, "\x1b[201~", 6) == 0) {
+            ab.len -= 6;
+            break;
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < ab.len; i++) {
+        c = ab.b[i];
+        if (c == '\r') {
+            if (i + 1 < ab.len && ab.b[i + 1] == '\n') continue;
+            c = '\n';
+        }
+        if (c == '\n' || c == '\t' || !iscntrl((unsigned char)c)) ab.b[n++] = c;
+    }
+    *len = n;
+    return ab.b;
+}
+
+/* Input prompt (status line). If given, callback sees the buffer after
+ * every key, including the final Enter or Escape. */
+char *editorPrompt(const char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+    buf[0] = '\0';
+    size_t buflen = 0;
+
+    while (1) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "%s%s", prompt, buf);
+        E.statusmsg_time = time(NULL);
+        editorRefreshScreen();
+
+        int c;
+        while ((c = editorReadKey()) == KEY_NONE)
+            ;
+        if (c == '\r') {
+            if (callback) callback(buf, c);
+            if (buflen != 0) return buf;
+            else { free(buf); return NULL; }
+        } else if (c == BACKSPACE || c == 8) {
+            while (buflen > 1 && (buf[buflen - 1] & 0xc0) == 0x80) buflen--;
+            if (buflen != 0) buf[--buflen] = '\0';
+        } else if (c < 256 && !iscntrl(c)) {
+            if (buflen + 1 >= bufsize) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        } else if (c == KEY_PASTE) {
+            int len;
+            char *paste = editorReadPaste(&len);
+            for (int i = 0; i < len && paste[i] != '\n'; i++) {
+                if (buflen + 1 >= bufsize) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = paste[i];
+            }
+            buf[buflen] = '\0';
+            free(paste);
+        } else if (c == '\x1b') {
+            if (callback) callback(buf, c);
+            free(buf);
+            return NULL;
+        }
+        if (callback) callback(buf, c);
+    }
+}
+
+/* Search.
+ * Rows are searched in place: the two halves of a gap buffer separately,
+ * plus a small window across the gap. Consecutive mapped rows that are still
+ * adjacent in the file (only line breaks between them) are searched as one
+ * span of the mapping, so an unedited file costs one findSubstr call per
+ * leaf. The query never contains a line break, so no match crosses one. */
+#define SEARCH_MAX 256
+
+struct searchState {
+    int active;             // the prompt is open: highlight matches
+    char query[SEARCH_MAX + 1];
+    int len;
+    int origin_row, origin_col;
+    int found, row, col;    // current match
+    // first match at or after origin for each query prefix length, so
+    // typing extends the previous result and backspace is free
+    struct { int valid, found, row, col; } step[SEARCH_MAX + 1];
+} search;
+
+/* First match in a row starting at or after column 'from', or -1 */
+int rowFind(erow *row, int from, const char *q, int qlen) {
+    if (from < 0) from = 0;
+    if (qlen == 0 || from + qlen > row->size) return -1;
+    const char *m;
+    if (from < row->gap && (m = findSubstr(row->chars + from, row->gap - from, q, qlen)))
+        return m - row->chars;
+    int taillen = row->size - row->gap;
+    if (row->gap > 0 && taillen > 0 && qlen > 1) {
+        // matches straddling the gap
+        char win[2 * SEARCH_MAX];
+        int a = row->gap - (qlen - 1);
+        if (a < from) a = from;
+        if (a < row->gap) {
+            int head = row->gap - a, tail = taillen < qlen - 1 ? taillen : qlen - 1;
+            memcpy(win, row->chars + a, head);
+            memcpy(win + head, rowTail(row), tail);
+            if ((m = findSubstr(win, head + tail, q, qlen))) return a + (m - win);
+        }
+    }
+    int t = from > row->gap ? from - row->gap : 0;
+    if (t < taillen && (m = findSubstr(rowTail(row) + t, taillen - t, q, qlen)))
+        return row->gap + (m - rowTail(row));
+    return -1;
+}
+
+/* Last match in a row starting before column 'before', or -1 */
+int rowFindLast(erow *row, int before, const char *q, int qlen) {
+    int last = -1, m = rowFind(row, 0, q, qlen);
+    while (m != -1 && m < before) {
+        last = m;
+        m = rowFind(row, m + 1, q, qlen);
+    }
+    return last;
+}
+
+/* Can rows a and b (b right after a) be searched as one span of the mapping? */
+int rowsAdjacent(erow *a, erow *b) {
+    if (!(a->flags & ROW_MAPPED) || !(b->flags & ROW_MAPPED)) return 0;
+    const char *p = a->chars + a->size, *end = b->chars;
+    if (end <= p || end - p > 8 || end[-1] != '\n') return 0;
+    for (; p < end - 1; p++) if (*p != '\r') return 0;
+    return 1;
+}
+
+/* Find the first match at or after (row, col), wrapping past the end */
+int editorFindNext(const char *q, int qlen, int row, int col, int *mrow, int *mcol) {
+    for (int pass = 0; pass < 2; pass++) {
+        int r = pass ? 0 : row, stop = pass ? row + 1 : E.numrows;
+        while (r < stop) {
+            editorRow(r); // leaves E.doc.hint at the leaf holding r
+            docnode *x = E.doc.hint;
+            int i = r - E.doc.hint_start;
+            int from = r == row && !pass ? col : 0;
+            // extend a run of rows that are one span of the mapping
+            int j = i;
+            while (j + 1 < x->n && r + (j + 1 - i) < stop && rowsAdjacent(&x->rows[j], &x->rows[j + 1])) j++;
+            if (j > i) {
+                erow *first = &x->rows[i], *lastrow = &x->rows[j];
+                const char *start = first->chars + (from < first->size ? from : first->size);
+                const char *end = lastrow->chars + lastrow->size;
+                const char *m = findSubstr(start, end - start, q, qlen);
+                if (m) {
+                    int k = i;
+                    while (m >= x->rows[k].chars + x->rows[k].size) k++;
+                    *mrow = r + (k - i);
+                    *mcol = m - x->rows[k].chars;
+                    return 1;
+                }
+            } else {
+                int m = rowFind(&x->rows[i], from, q, qlen);
+                if (m != -1) { *mrow = r; *mcol = m; return 1; }
+            }
+            r += j - i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Find the last match before (row, col), wrapping past the start */
+int editorFindPrev(const char *q, int qlen, int row, int col, int *mrow, int *mcol) {
+    for (int n = 0; n <= E.numrows + 1; n++) {
+        int r = row - n;
+        if (r < 0) r += E.numrows + 1;
+        if (r >= E.numrows) continue;
+        int m = rowFindLast(editorRow(r), n == 0 ? col : INT_MAX, q, qlen);
+        if (m != -1) { *mrow = r; *mcol = m; return 1; }
+    }
+    return 0;
+}
+
+void editorFindCallback(char *buf, int key) {
+    if (key == '\r' || key == '\x1b') return;
+    int len = strlen(buf);
+    if (len > SEARCH_MAX) len = SEARCH_MAX;
+
+    int dir = 0;
+    if (key == ARROW_DOWN || key == ARROW_RIGHT || key == '\x17') dir = 1;
+    else if (key == ARROW_UP || key == ARROW_LEFT) dir = -1;
+
+    if (dir) {
+        if (!search.found) return;
+        // the current match is always found again, at worst after wrapping
+        if (dir > 0)
+            editorFindNext(search.query, search.len, search.row, search.col + 1, &search.row, &search.col);
+        else
+            editorFindPrev(search.query, search.len, search.row, search.col, &search.row, &search.col);
+        // results for shorter queries were relative to the old origin
+        search.origin_row = search.row;
+        search.origin_col = search.col;
+        for (int k = 0; k <= SEARCH_MAX; k++) search.step[k].valid = 0;
+        search.step[len].valid = 1;
+        search.step[len].found = 1;
+        search.step[len].row = search.row;
+        search.step[len].col = search.col;
+    } else {
+        // forget results for prefixes the new query does not share
+        int common = 0;
+        while (common < len && common < search.len && buf[common] == search.query[common]) common++;
+        for (int k = common + 1; k <= SEARCH_MAX; k++) search.step[k].valid = 0;
+        memcpy(search.query, buf, len);
+        search.query[len] = '\0';
+        search.len = len;
+
+        if (!search.step[len].valid) {
+            int found = 0, row = 0, col = 0;
+            if (len == 0) {
+                found = 1; // the empty query matches at the origin
+                row = search.origin_row;
+                col = search.origin_col;
+            } else if (search.step[len - 1].valid) {
+                // a match of the longer query is a match of the shorter one
+                if (search.step[len - 1].found)
+                    found = editorFindNext(search.query, len, search.step[len - 1].row, search.step[len - 1].col, &row, &col);
+            } else {
+                found = editorFindNext(search.query, len, search.origin_row, search.origin_col, &row, &col);
+            }
+            search.step[len].valid = 1;
+            search.step[len].found = found;
+            search.step[len].row = row;
+            search.step[len].col = col;
+        }
+        search.found = len > 0 && search.step[len].found;
+        search.row = search.step[len].row;
+        search.col = search.step[len].col;
+    }
+
+    if (search.found) {
+        E.cy = search.row;
+        E.cx = search.col;
+    } else {
+        E.cy = search.origin_row;
+        E.cx = search.origin_col;
+    }
+    editorInvalidateScreen(); // highlights changed
+}
+
+void editorFind() {
+    int cx = E.cx, cy = E.cy, rowoff = E.rowoff, coloff = E.coloff, segoff = E.segoff;
+    editorLoadAll();
+    memset(&search, 0, sizeof(search));
+    search.active = 1;
+    search.origin_row = E.cy;
+    search.origin_col = E.cx;
+
+    char *q = editorPrompt("Search (arrows: prev/next, Esc: cancel): ", editorFindCallback);
+    search.active = 0;
+    editorInvalidateScreen();
+    if (q && !search.found) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Not found: %.60s", search.query);
+        E.statusmsg_time = time(NULL);
+    }
+    if (q == NULL || !search.found) {
+        E.cx = cx; E.cy = cy; E.rowoff = rowoff; E.coloff = coloff; E.segoff = segoff;
+    }
+    free(q);
+}
+
+/* Thread pool.
+ * Each worker owns a deque of tasks. It pops its own tasks from the back
+ * and, once it runs out, steals from the front of the others'. poolRun()
+ * deals a batch out round-robin and waits until every task is done. The
+ * workers only read the document; results are applied on the UI thread. */
+#define POOL_MAX 64
+
+typedef void (*taskFn)(void *arg);
+
+struct task {
+    taskFn fn;
+    void *arg;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    struct task *t;
+    int head, tail, cap;    // tasks are t[head..tail)
+};
+
+struct pool {
+    int n;                  // worker threads
+    struct deque q[POOL_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    atomic_int queued;      // tasks not picked up yet
+    int pending;            // tasks not finished
+} pool;
+
+int dequeTake(struct deque *d, struct task *t, int back) {
+    pthread_mutex_lock(&d->lock);
+    int ok = d->head < d->tail;
+    if (ok) *t = back ? d->t[--d->tail] : d->t[d->head++];
+    pthread_mutex_unlock(&d->lock);
+    if (ok) atomic_fetch_sub(&pool.queued, 1);
+    return ok;
+}
+
+void *poolWorker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    while (1) {
+        struct task t;
+        int got = dequeTake(&pool.q[id], &t, 1);
+        for (int k = 1; !got && k < pool.n; k++) got = dequeTake(&pool.q[(id + k) % pool.n], &t, 0);
+        if (got) {
+            t.fn(t.arg);
+            pthread_mutex_lock(&pool.lock);
+            if (--pool.pending == 0) pthread_cond_signal(&pool.done);
+            pthread_mutex_unlock(&pool.lock);
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        while (atomic_load(&pool.queued) == 0) pthread_cond_wait(&pool.work, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/* Start one worker per CPU the first time the pool is used (just one in
+ * batch mode, which runs a process per CPU already) */
+void poolInit() {
+    if (pool.n) return;
+    simdInit(); // before the workers exist, in case initEditor hasn't run
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = ncpu < 1 || E.batch ? 1 : ncpu > POOL_MAX ? POOL_MAX : ncpu;
+    for (int i = 0; i < n; i++) pthread_mutex_init(&pool.q[i].lock, NULL);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.n = n;
+    for (int i = 0; i < n; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, poolWorker, (void *)(intptr_t)i) != 0) die("pthread_create");
+        pthread_detach(t);
+    }
+}
+
+/* Run fn(arg + i * size) for i in 0..n-1 on the pool and wait for all */
+void poolRun(taskFn fn, void *args, size_t size, int n) {
+    poolInit();
+    for (int i = 0; i < n; i++) {
+        struct deque *d = &pool.q[i % pool.n];
+        pthread_mutex_lock(&d->lock);
+        if (d->tail == d->cap) {
+            // compact, then grow
+            memmove(d->t, d->t + d->head, sizeof(struct task) * (d->tail - d->head));
+            d->tail -= d->head;
+            d->head = 0;
+            if (d->tail == d->cap) {
+                d->cap = d->cap ? d->cap * 2 : 64;
+                d->t = realloc(d->t, sizeof(struct task) * d->cap);
+                if (d->t == NULL) die("realloc");
+            }
+        }
+        d->t[d->tail++] = (struct task){fn, (char *)args + i * size};
+        pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.pending += n;
+    atomic_fetch_add(&pool.queued, n);
+    pthread_cond_broadcast(&pool.work);
+    while (pool.pending > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Replace all.
+ * The leaves are cut into chunks that the pool searches in parallel. A
+ * worker writes the new text of every row it changes into its chunk's own
+ * buffer; the UI thread then walks the chunks in order and moves that text
+ * into the rows. Neither string holds a line break, so lines never split
+ * or join and chunks are independent. */
+#define REPLACE_CHUNK_LEAVES 16
+
+struct replaceChunk {
+    docnode *leaf;          // first leaf of the chunk
+    int nleaves;
+    const char *q, *with;
+    int qlen, wlen;
+    struct abuf text;       // new text of the changed rows, back to back
+    int line;               // index of the chunk's first row
+    struct replaceRow { docnode *leaf; int i, line, off, len; } *rows;
+    int nrows, caprows;
+    long matches;
+};
+
+void replaceChunkRun(void *arg) {
+    struct replaceChunk *c = arg;
+    docnode *x = c->leaf;
+    int line = c->line;
+    for (int l = 0; l < c->nleaves; l++, line += x->n, x = x->next) {
+        for (int i = 0; i < x->n; i++) {
+            erow *row = &x->rows[i];
+            int m = rowFind(row, 0, c->q, c->qlen);
+            if (m == -1) continue;
+            int off = c->text.len, at = 0;
+            while (m != -1) {
+                abGrow(&c->text, (m - at) + c->wlen);
+                rowCopy(row, at, m - at, c->text.b + c->text.len);
+                c->text.len += m - at;
+                abAppend(&c->text, c->with, c->wlen);
+                at = m + c->qlen;
+                c->matches++;
+                m = rowFind(row, at, c->q, c->qlen);
+            }
+            abGrow(&c->text, row->size - at);
+            rowCopy(row, at, row->size - at, c->text.b + c->text.len);
+            c->text.len += row->size - at;
+            if (c->nrows == c->caprows) {
+                c->caprows = c->caprows ? c->caprows * 2 : 64;
+                c->rows = realloc(c->rows, sizeof(struct replaceRow) * c->caprows);
+                if (c->rows == NULL) die("realloc");
+            }
+            c->rows[c->nrows++] = (struct replaceRow){x, i, line + i, off, c->text.len - off};
+        }
+    }
+}
+
+/* Replace every occurrence of q with 'with'. Returns the number replaced. */
+long editorReplaceAll(const char *q, int qlen, const char *with, int wlen, int *nrows) {
+    editorLoadAll();
+    docnode *x = E.doc.root;
+    while (!x->leaf) x = x->child[0];
+    int nleaves = 0, line = 0;
+    for (docnode *l = x; l; l = l->next) nleaves++;
+    int nchunks = (nleaves + REPLACE_CHUNK_LEAVES - 1) / REPLACE_CHUNK_LEAVES;
+    struct replaceChunk *chunks = calloc(nchunks ? nchunks : 1, sizeof(struct replaceChunk));
+    if (chunks == NULL) die("calloc");
+    for (int c = 0; c < nchunks; c++) {
+        chunks[c].leaf = x;
+        chunks[c].nleaves = nleaves - c * REPLACE_CHUNK_LEAVES < REPLACE_CHUNK_LEAVES
+                          ? nleaves - c * REPLACE_CHUNK_LEAVES : REPLACE_CHUNK_LEAVES;
+        chunks[c].q = q; chunks[c].qlen = qlen;
+        chunks[c].with = with; chunks[c].wlen = wlen;
+        chunks[c].line = line;
+        for (int l = 0; l < chunks[c].nleaves; l++, x = x->next) line += x->n;
+    }
+    poolRun(replaceChunkRun, chunks, sizeof(struct replaceChunk), nchunks);
+
+    long matches = 0;
+    *nrows = 0;
+    for (int c = 0; c < nchunks; c++) {
+        struct replaceChunk *ch = &chunks[c];
+        for (int k = 0; k < ch->nrows; k++) {
+            erow *row = &ch->rows[k].leaf->rows[ch->rows[k].i];
+            // one undo step puts every line back
+            undorec *r = undoAdd(UNDO_DELETE, ch->rows[k].line, 0, row->size, *nrows > 0 || k > 0);
+            rowCopy(row, 0, row->size, undoText(r));
+            swapAppend(UNDO_DELETE, 0, r->row, 0, undoText(r), r->len);
+            r = undoAdd(UNDO_INSERT, ch->rows[k].line, 0, ch->rows[k].len, 1);
+            memcpy(undoText(r), ch->text.b + ch->rows[k].off, ch->rows[k].len);
+            swapAppend(UNDO_INSERT, 0, r->row, 0, undoText(r), r->len);
+            rowFree(&E.doc.mem, row);
+            editorMarkRowDirty(ch->rows[k].line);
+            if (ch->rows[k].len) {
+                row->chars = arenaAlloc(&E.doc.mem, ch->rows[k].len, &row->cap);
+                memcpy(row->chars, ch->text.b + ch->rows[k].off, ch->rows[k].len);
+                row->size = row->gap = ch->rows[k].len;
+            }
+        }
+        matches += ch->matches;
+        *nrows += ch->nrows;
+        abFree(&ch->text);
+        free(ch->rows);
+    }
+    free(chunks);
+    if (matches) {
+        E.dirty = 1;
+        editorInvalidateScreen();
+        editorClampCursor();
+    }
+    return matches;
+}
+
+int replaceConfirmed; // Enter ended the last replace prompt
+
+void editorReplaceCallback(char *buf, int key) {
+    (void)buf;
+    replaceConfirmed = key == '\r';
+}
+
+void editorReplace() {
+    char *q = editorPrompt("Replace: ", NULL);
+    if (q == NULL) return;
+    char prompt[80];
+    snprintf(prompt, sizeof(prompt), "Replace '%.40s' with: ", q);
+    char *with = editorPrompt(prompt, editorReplaceCallback);
+    if (with == NULL && !replaceConfirmed) { free(q); return; } // Esc; Enter alone means ""
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int nrows;
+    long n = editorReplaceAll(q, strlen(q), with ? with : "", with ? strlen(with) : 0, &nrows);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    snprintf(E.statusmsg, sizeof(E.statusmsg), "Replaced %ld on %d lines in %.1f ms (%d threads)",
+             n, nrows, ms, pool.n);
+    E.statusmsg_time = time(NULL);
+    free(q);
+    free(with);
+}
+
+/* Output rendering */
+/* With wrap the view starts at segment segoff of row rowoff. The screen
+ * lines before a row come from the document tree, so keeping the cursor in
+ * view costs O(log n) wherever it is. */
+void editorScrollWrapped() {
+    E.coloff = 0;
+    E.cseg = E.wrapx = 0;
+    if (E.cy < E.numrows) {
+        erow *row = editorRow(E.cy);
+        int w;
+        wrapSegments(row, E.rx, &E.cseg, 0, NULL, 0);
+        E.wrapx = wrapSegmentStart(row, E.cseg, &w);
+    }
+    if (E.rowoff >= E.numrows) {
+        E.rowoff = E.numrows;
+        E.segoff = 0;
+    } else {
+        int n = wrapRowLines(editorRow(E.rowoff));
+        if (E.segoff >= n) E.segoff = n - 1;
+    }
+    if (E.cy < E.rowoff || (E.cy == E.rowoff && E.cseg < E.segoff)) {
+        E.rowoff = E.cy;
+        E.segoff = E.cseg;
+    }
+    long top = docLinesBefore(&E.doc, E.rowoff) + E.segoff;
+    long cur = docLinesBefore(&E.doc, E.cy) + E.cseg;
+    if (cur - top >= E.screenrows) {
+        top = cur - E.screenrows + 1;
+        E.rowoff = docRowAtLine(&E.doc, top, &E.segoff);
+    }
+    E.wrapy = cur - top;
+}
+
+/* Line numbers take the digits of the last one and a space. The width
+ * changes only when E.numrows gains or loses a digit; then the text area
+ * is narrowed or widened and the screen laid out again. */
+void editorUpdateGutter() {
+    int w = 0;
+    if (E.lineno) {
+        w = 2;
+        for (int n = E.numrows; n >= 10; n /= 10) w++;
+        if (w >= E.termcols) w = 0; // no room for text
+    }
+    if (w == E.gutter) return;
+    E.gutter = w;
+    E.screencols = E.termcols - w;
+    if (E.wrap) docNodeStaleAll(E.doc.root);
+    editorInvalidateScreen();
+}
+
+void editorScroll() {
+    if (pager.on && !E.wrap) return; // the pager moves the view itself
+    editorUpdateGutter();
+    E.rx = E.cy < E.numrows ? rowCxToRx(editorRow(E.cy), E.cx) : 0;
+    if (E.wrap) {
+        editorScrollWrapped();
+        return;
+    }
+    if (E.cy < E.rowoff) E.rowoff = E.cy;
+    if (E.cy >= E.rowoff + E.screenrows) E.rowoff = E.cy - E.screenrows + 1;
+    if (E.rx < E.coloff) E.coloff = E.rx;
+    if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
+}
+
+/* Append bytes from..to of a row as they show on screen */
+void rowAppendRendered(struct abuf *ab, erow *row, rowrender *r, int from, int to) {
+    if (r) abAppend(ab, r->render + r->ri[from], r->ri[to] - r->ri[from]);
+    else rowAppendTo(ab, row, from, to - from);
+}
+
+/* Colour of each byte in [start, end) of a row: its syntax, with search
+ * matches on top. NULL when it is all plain. */
+unsigned char *editorRowColours(erow *row, int filerow, int start, int end) {
+    static struct abuf hl = ABUF_INIT;
+    int searching = search.active && search.len > 0;
+    if (E.syntax == NULL && !searching) return NULL;
+    // a little past the edge, so tokens cut by it are still recognized
+    int len = row->size - end > 256 ? end + 256 : row->size;
+    abGrow(&hl, len);
+    unsigned char *c = (unsigned char *)hl.b;
+    if (E.syntax) hlLexRow(row, len, hlStartState(filerow), c);
+    else memset(c, HL_NORMAL, end);
+
+    int found = E.syntax != NULL;
+    if (searching) {
+        // the visible part of every match, the current one reversed
+        int m = rowFind(row, start - search.len + 1, search.query, search.len);
+        while (m != -1 && m < end) {
+            int ms = m > start ? m : start, me = m + search.len < end ? m + search.len : end;
+            int current = search.found && filerow == search.row && m == search.col;
+            memset(c + ms, current ? HL_CURRENT : HL_MATCH, me - ms);
+            found = 1;
+            m = rowFind(row, m + 1, search.query, search.len);
+        }
+    }
+    return found ? c : NULL;
+}
+
+void editorDrawRow(struct abuf *ab, int y) {
+    int filerow = y + E.rowoff, col = E.coloff, width = E.screencols;
+    if (E.wrap) {
+        filerow = E.layout[y].row;
+        if (filerow < E.numrows) col = wrapSegmentStart(editorRow(filerow), E.layout[y].seg, &width);
+    }
+    if (E.gutter && filerow < E.numrows) {
+        if (E.wrap && E.layout[y].seg > 0) {
+            abAppendFill(ab, ' ', E.gutter); // the row goes on from the line above
+        } else {
+            char num[16];
+            int len = snprintf(num, sizeof(num), "\x1b[2m%*d\x1b[m ", E.gutter - 1, filerow + 1);
+            abAppend(ab, num, len);
+        }
+    }
+    if (filerow >= E.numrows) {
+        if (E.numrows == 0 && y == E.screenrows/3) {
+            char welcome[80];
+            int welcomelen = snprintf(welcome, sizeof(welcome), "mini_nano -- simple editor");
+            if (welcomelen > E.screencols) welcomelen = E.screencols;
+            int padding = (E.screencols - welcomelen) / 2;
+            if (padding) {
+                abAppend(ab, "~", 1);
+                padding--;
+            }
+            abAppendFill(ab, ' ', padding);
+            abAppend(ab, welcome, welcomelen);
+        } else {
+            abAppend(ab, "~", 1);
+        }
+    } else {
+        erow *row = editorRow(filerow);
+        rowrender *r = rowRender(&E.doc.mem, row);
+        // the bytes [start, end) fit in columns col .. col + width
+        int start, end, pad = 0, cols;
+        if (r == NULL) {
+            start = col < row->size ? col : row->size;
+            end = row->size - start > width ? start + width : row->size;
+            cols = end - start;
+        } else {
+            start = rowRxToCx(row, col);
+            if (r->rx[start] < col) start++; // a tab or wide character cut by the edge
+            while (rowIsCont(row, start)) start++;
+            end = rowRxToCx(row, col + width);
+            if (end < start) end = start;
+            pad = r->rx[start] - col;
+            if (pad > width) pad = width;
+            cols = pad + r->rx[end] - r->rx[start];
+            abAppendFill(ab, ' ', pad);
+        }
+        unsigned char *hl = end > start ? editorRowColours(row, filerow, start, end) : NULL;
+        if (hl) {
+            // one run per colour, with an SGR only where the colour changes
+            int cur = HL_NORMAL;
+            for (int i = start; i < end;) {
+                int j = i + 1;
+                while (j < end && hl[j] == hl[i]) j++;
+                if (hl[i] != cur) {
+                    cur = hl[i];
+                    abAppend(ab, hlSGR[cur], strlen(hlSGR[cur]));
+                }
+                rowAppendRendered(ab, row, r, i, j);
+                i = j;
+            }
+            if (cur != HL_NORMAL) abAppend(ab, "\x1b[m", 3);
+        } else if (end > start) {
+            rowAppendRendered(ab, row, r, start, end);
+        }
+        if (cols == E.screencols) return;
+    }
+    abAppend(ab, "\x1b[K", 3); // not on full rows: EL at the wrap column erases the last cell
+}
+
+/* With wrap: which segment of which row each screen row shows. Rows past
+ * the end get numbers of their own so the '~' lines compare equal too. */
+void editorLayoutWrapped() {
+    int row = E.rowoff, seg = E.segoff;
+    int n = row < E.numrows ? wrapRowLines(editorRow(row)) : 1;
+    for (int y = 0; y < E.screenrows; y++) {
+        E.layout[y].row = row;
+        E.layout[y].seg = seg;
+        if (++seg < n) continue;
+        seg = 0;
+        row++;
+        n = row < E.numrows ? wrapRowLines(editorRow(row)) : 1;
+    }
+}
+
+int wrapSame(struct wrapline a, struct wrapline b) {
+    return a.row == b.row && a.seg == b.seg;
+}
+
+/* With wrap the view moves by screen lines, not rows: find the shift from
+ * the layout, scroll for it, and repaint every screen row that changed */
+void editorScrollWrappedView() {
+    editorLayoutWrapped();
+    if (E.fullredraw) return;
+    struct wrapline *was = E.drawn_layout, *now = E.layout;
+    int n = E.screenrows, shift = 0;
+    if (!wrapSame(now[0], was[0])) {
+        for (int k = 1; k < n && !shift; k++) {
+            if (wrapSame(was[k], now[0])) shift = k;
+            else if (wrapSame(now[k], was[0])) shift = -k;
+        }
+    }
+    if (shift) {
+        editorScrollRegion(0, n - 1, shift);
+        if (E.fullredraw) return;
+        int an = shift > 0 ? shift : -shift;
+        if (shift > 0) memmove(was, was + an, sizeof(*was) * (n - an));
+        else memmove(was + an, was, sizeof(*was) * (n - an));
+    }
+    for (int y = 0; y < n; y++)
+        if (!wrapSame(now[y], was[y])) E.damage[y] = 1;
+}
+
+/* Bring the terminal up to date: replay queued scrolls, scroll for a
+ * rowoff change, then repaint only the damaged rows */
+void editorDrawRows(struct abuf *ab) {
+    if ((E.numrows == 0) != E.drawn_empty || E.coloff != E.drawn_coloff) editorInvalidateScreen();
+    hlSync(E.rowoff + E.screenrows); // can mark rows whose colours changed
+
+    int delta = E.rowoff - E.drawn_rowoff;
+    if (E.wrap) editorScrollWrappedView();
+    else if (delta) editorScrollRegion(0, E.screenrows - 1, delta);
+
+    if (E.fullredraw) {
+        memset(E.damage, 1, E.screenrows);
+    } else if (scrollops.len) {
+        abAppend(ab, scrollops.b, scrollops.len);
+        abAppend(ab, "\x1b[r", 3); // reset the scroll region
+    }
+
+    for (int y = 0; y < E.screenrows; y++) {
+        if (!E.damage[y]) continue;
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+        abAppend(ab, buf, len);
+        editorDrawRow(ab, y);
+        E.damage[y] = 0;
+    }
+
+    scrollops.len = 0;
+    if (E.wrap) memcpy(E.drawn_layout, E.layout, sizeof(*E.layout) * E.screenrows);
+    E.drawn_rowoff = E.rowoff;
+    E.drawn_coloff = E.coloff;
+    E.drawn_empty = E.numrows == 0;
+}
+
+void editorDrawStatusBar(struct abuf *ab) {
+    abAppend(ab, "\x1b[7m", 4); // invert colors
+    char status[80], rstatus[80];
+    int len = snprintf(status, sizeof(status), "%.20s %s%s", E.filename[0] ? E.filename : "[No Name]",
+                       pager.on ? " (read-only)" : E.dirty ? " (modified)" : "", follow.on ? " (following)" : "");
+    int rlen;
+    char progress[32] = "";
+    if (E.doc.loading)
+        snprintf(progress, sizeof(progress), " (indexing %d%%)", (int)(E.doc.load_off * 100 / E.doc.maplen));
+    char ft[32] = "";
+    if (buffers.n > 1) snprintf(ft, sizeof(ft), "[%d/%d] | ", buffers.cur + 1, buffers.n);
+    if (E.syntax) snprintf(ft + strlen(ft), sizeof(ft) - strlen(ft), "%s | ", E.syntax->name);
+    if (pager.on) {
+        int pct = E.doc.maplen ? (int)(pager.end * 100 / E.doc.maplen) : 100;
+        if (pager.line >= 0)
+            rlen = snprintf(rstatus, sizeof(rstatus), "%sline %ld | %d%%", ft, pager.line + 1, pct);
+        else
+            rlen = snprintf(rstatus, sizeof(rstatus), "%s%d%%", ft, pct);
+    } else if (E.debug)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s%d lines%s | frame: %d write, %d bytes",
+                        ft, E.numrows, progress, E.frame_writes, E.frame_bytes);
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s%d lines%s", ft, E.numrows, progress);
+    if (len > E.termcols) len = E.termcols;
+    abAppend(ab, status, len);
+    if (E.termcols - len >= rlen) {
+        abAppendFill(ab, ' ', E.termcols - len - rlen);
+        abAppend(ab, rstatus, rlen);
+    } else {
+        abAppendFill(ab, ' ', E.termcols - len);
+    }
+    abAppend(ab, "\x1b[m", 3);
+}
+
+/* Human-readable byte count: 512B, 12.3K, 4.0M, ... */
+void editorFormatBytes(char *buf, size_t bufsz, size_t n) {
+    const char *units = "BKMGT";
+    double v = n;
+    int u = 0;
+    while (v >= 1024 && u < 4) { v /= 1024; u++; }
+    if (u == 0) snprintf(buf, bufsz, "%zuB", n);
+    else snprintf(buf, bufsz, "%.1f%c", v, units[u]);
+}
+
+/* Microseconds as 850us, 12.3ms, 1.20s */
+void editorFormatUs(char *buf, size_t bufsz, unsigned long us) {
+    if (us < 1000) snprintf(buf, bufsz, "%luus", us);
+    else if (us < 1000000) snprintf(buf, bufsz, "%.1fms", us / 1e3);
+    else snprintf(buf, bufsz, "%.2fs", us / 1e6);
+}
+
+void editorDrawMessageBar(struct abuf *ab) {
+    abAppend(ab, "\x1b[K", 3);
+    char dbg[80];
+    int msglen = strlen(E.statusmsg);
+    const char *msg = E.statusmsg;
+    if (!(msglen && time(NULL) - E.statusmsg_time < 5)) {
+        msglen = 0;
+        if (E.debug == 1) {
+            // allocator stats in place of the message
+            arena *a = &E.doc.mem;
+            char used[16], reserved[16];
+            editorFormatBytes(used, sizeof(used), a->used);
+            editorFormatBytes(reserved, sizeof(reserved), a->reserved);
+            int frag = a->reserved ? (int)((a->reserved - a->used) * 100 / a->reserved) : 0;
+            msglen = snprintf(dbg, sizeof(dbg), "arena: %s used, %s reserved, %d%% free, %d big",
+                              used, reserved, frag, a->nbig);
+            if (msglen >= (int)sizeof(dbg)) msglen = sizeof(dbg) - 1;
+            msg = dbg;
+        } else if (E.debug == 2) {
+            // latency percentiles in place of the message
+            char k50[16], k99[16], d50[16], d99[16];
+            editorFormatUs(k50, sizeof(k50), histPercentile(&stats.h[ST_KEY], 0.5));
+            editorFormatUs(k99, sizeof(k99), histPercentile(&stats.h[ST_KEY], 0.99));
+            editorFormatUs(d50, sizeof(d50), histPercentile(&stats.h[ST_DRAW], 0.5));
+            editorFormatUs(d99, sizeof(d99), histPercentile(&stats.h[ST_DRAW], 0.99));
+            msglen = snprintf(dbg, sizeof(dbg), "key->frame p50 %s p99 %s | draw p50 %s p99 %s | %lu allocs",
+                              k50, k99, d50, d99, (unsigned long)stats.allocs);
+            if (msglen >= (int)sizeof(dbg)) msglen = sizeof(dbg) - 1;
+            msg = dbg;
+        }
+    }
+    if (msglen > E.termcols) msglen = E.termcols;
+    if (msglen) abAppend(ab, msg, msglen);
+    E.drawn_msg = msg == E.statusmsg && msglen > 0;
+}
+
+void editorRefreshScreen() {
+    static struct abuf ab = ABUF_INIT; // reused between frames
+    static struct abuf bars = ABUF_INIT, drawnbars = ABUF_INIT;
+    long long t0 = monotonicUs();
+    editorScroll();
+
+    ab.len = 0;
+    abAppend(&ab, "\x1b[?25l", 6); // hide cursor
+
+    editorDrawRows(&ab);
+
+    // status and message bars, only when they changed
+    char buf[32];
+    bars.len = 0;
+    int blen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 1);
+    abAppend(&bars, buf, blen);
+    editorDrawStatusBar(&bars);
+    abAppend(&bars, "\r\n", 2);
+    editorDrawMessageBar(&bars);
+    if (E.fullredraw || bars.len != drawnbars.len || memcmp(bars.b, drawnbars.b, bars.len) != 0) {
+        abAppend(&ab, bars.b, bars.len);
+        struct abuf t = drawnbars; drawnbars = bars; bars = t;
+    }
+    E.fullredraw = 0;
+
+    // position cursor
+    if (pager.on)
+        blen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 2);
+    else if (E.wrap)
+        blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.wrapy + 1, (E.rx - E.wrapx) + 1 + E.gutter);
+    else
+        blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1 + E.gutter);
+    abAppend(&ab, buf, blen);
+    abAppend(&ab, "\x1b[?25h", 6); // show cursor
+
+    E.frame_bytes = ab.len;
+    E.frame_writes = abFlush(&ab);
+
+    long long t1 = monotonicUs();
+    histRecord(&stats.h[ST_DRAW], t1 - t0);
+    histRecord(&stats.h[ST_BYTES], E.frame_bytes);
+    histRecord(&stats.h[ST_WRITES], E.frame_writes);
+    if (stats.key_at) {
+        histRecord(&stats.h[ST_KEY], t1 - stats.key_at);
+        stats.key_at = 0;
+    }
+}
+
+/* Input handling */
+/* The line past the end has no characters */
+void editorClampCursor() {
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    if (E.cy < 0) E.cy = 0;
+    int rowlen = E.cy < E.numrows ? editorRow(E.cy)->size : 0;
+    if (E.cx > rowlen) E.cx = rowlen;
+    // never inside a UTF-8 character
+    if (E.cy < E.numrows)
+        while (rowIsCont(editorRow(E.cy), E.cx)) E.cx--;
+}
+
+/* Up and down keep the screen column rather than the byte offset */
+void editorMoveLine(int cy) {
+    int rx = E.cy < E.numrows ? rowCxToRx(editorRow(E.cy), E.cx) : 0;
+    E.cy = cy;
+    if (E.cy < E.numrows) E.cx = rowRxToCx(editorRow(E.cy), rx);
+}
+
+/* With wrap: the screen line the cursor is on, and its column within it */
+long editorWrapCursor(int *col) {
+    if (E.cy >= E.numrows) {
+        *col = 0;
+        return docLinesBefore(&E.doc, E.numrows);
+    }
+    erow *row = editorRow(E.cy);
+    int rx = rowCxToRx(row, E.cx), seg, w;
+    wrapSegments(row, rx, &seg, 0, NULL, 0);
+    *col = rx - wrapSegmentStart(row, seg, &w);
+    return docLinesBefore(&E.doc, E.cy) + seg;
+}
+
+/* With wrap: put the cursor on screen line 'line' (past the end: the last
+ * row), as near column 'col' as that line allows */
+void editorWrapGoto(long line, int col) {
+    int seg, w;
+    E.cy = docRowAtLine(&E.doc, line, &seg);
+    E.cx = 0;
+    if (E.cy >= E.numrows) return;
+    erow *row = editorRow(E.cy);
+    int start = wrapSegmentStart(row, seg, &w);
+    if (seg + 1 < wrapRowLines(row) && col >= w) col = w - 1; // stay on this line
+    E.cx = rowRxToCx(row, start + col);
+    // a tab split by the edge belongs to the line above
+    if (E.cx < row->size && rowCxToRx(row, E.cx) < start) {
+        do E.cx++; while (rowIsCont(row, E.cx));
+    }
+}
+
+/* With wrap: move the view by 'delta' screen lines and return the new top */
+long editorWrapView(long delta) {
+    long top = docLinesBefore(&E.doc, E.rowoff) + E.segoff + delta;
+    long total = docLinesBefore(&E.doc, E.numrows);
+    if (top > total) top = total;
+    if (top < 0) top = 0;
+    E.rowoff = docRowAtLine(&E.doc, top, &E.segoff);
+    return top;
+}
+
+void editorMoveCursor(int key) {
+    switch (key) {
+        case ARROW_UP:
+            if (E.wrap) {
+                int col;
+                long line = editorWrapCursor(&col);
+                if (line > 0) editorWrapGoto(line - 1, col);
+            } else if (E.cy > 0) editorMoveLine(E.cy - 1);
+            break;
+        case ARROW_DOWN:
+            if (E.wrap) {
+                int col;
+                long line = editorWrapCursor(&col);
+                if (E.cy < E.numrows) editorWrapGoto(line + 1, col);
+            } else if (E.cy < E.numrows) editorMoveLine(E.cy + 1);
+            break;
+        case ARROW_RIGHT:
+            if (E.cy < E.numrows && E.cx < editorRow(E.cy)->size) {
+                erow *row = editorRow(E.cy);
+                do E.cx++; while (rowIsCont(row, E.cx));
+            } else if (E.cy < E.numrows && E.cx == editorRow(E.cy)->size) { E.cy++; E.cx = 0; }
+            break;
+        case ARROW_LEFT:
+            if (E.cx > 0) {
+                erow *row = editorRow(E.cy);
+                do E.cx--; while (rowIsCont(row, E.cx));
+            } else if (E.cy > 0) { E.cy--; E.cx = editorRow(E.cy)->size; }
+            break;
+        case ARROW_RIGHT | KEY_CTRL: { // to the end of the word
+            if (E.cy == E.numrows) break;
+            erow *row = editorRow(E.cy);
+            if (E.cx == row->size) { editorMoveCursor(ARROW_RIGHT); break; }
+            while (E.cx < row->size && !isalnum((unsigned char)rowAt(row, E.cx))) E.cx++;
+            while (E.cx < row->size && isalnum((unsigned char)rowAt(row, E.cx))) E.cx++;
+            break; }
+        case ARROW_LEFT | KEY_CTRL: { // to the start of the word
+            if (E.cx == 0 || E.cy == E.numrows) { editorMoveCursor(ARROW_LEFT); break; }
+            erow *row = editorRow(E.cy);
+            while (E.cx > 0 && !isalnum((unsigned char)rowAt(row, E.cx - 1))) E.cx--;
+            while (E.cx > 0 && isalnum((unsigned char)rowAt(row, E.cx - 1))) E.cx--;
+            break; }
+        case HOME_KEY:
+            E.cx = 0;
+            break;
+        case END_KEY:
+            if (E.cy < E.numrows) E.cx = editorRow(E.cy)->size;
             break;
-        case 'C' + 1000: // right
-            if (E.cy < E.numrows && E.cx < E.rows[E.cy].size) E.cx++;
-            else if (E.cy < E.numrows && E.cx == E.rows[E.cy].size) { E.cy++; E.cx = 0; }
+        case HOME_KEY | KEY_CTRL:
+            E.cy = E.cx = 0;
             break;
-        case 'D' + 1000: // left
-            if (E.cx > 0) E.cx--;
-            else if (E.cy > 0) { E.cy--; E.cx = E.rows[E.cy].size; }
+        case END_KEY | KEY_CTRL:
+            E.cy = E.numrows;
             break;
+        case PAGE_UP:
+        case PAGE_DOWN: {
+            // move the view and the cursor a full screen at once
+            int delta = key == PAGE_UP ? -E.screenrows : E.screenrows;
+            if (E.wrap) {
+                int col;
+                long line = editorWrapCursor(&col);
+                editorWrapView(delta);
+                editorWrapGoto(line + delta < 0 ? 0 : line + delta, col);
+                break;
+            }
+            int maxoff = E.numrows > E.screenrows ? E.numrows - E.screenrows + 1 : 0;
+            E.rowoff += delta;
+            if (E.rowoff > maxoff) E.rowoff = maxoff;
+            if (E.rowoff < 0) E.rowoff = 0;
+            E.cy += delta;
+            break; }
+    }
+    editorClampCursor();
+}
+
+/* With wrap the same, by screen lines */
+void editorMouseWrapped() {
+    int col;
+    long line = editorWrapCursor(&col);
+    if (mouse.button == 64 || mouse.button == 65) {
+        long top = editorWrapView(mouse.button == 64 ? -3 : 3);
+        if (line < top) editorWrapGoto(top, col);
+        else if (line >= top + E.screenrows) editorWrapGoto(top + E.screenrows - 1, col);
+    } else if (mouse.button == 0 && mouse.y >= 0 && mouse.y < E.screenrows) {
+        struct wrapline at = E.drawn_layout[mouse.y];
+        if (at.row >= E.numrows) editorWrapGoto(docLinesBefore(&E.doc, E.numrows), 0);
+        else editorWrapGoto(docLinesBefore(&E.doc, at.row) + at.seg, mouse.x);
+    }
+    editorClampCursor();
+}
+
+/* Wheel scrolls the view (dragging the cursor along), a click moves the cursor */
+void editorMouse() {
+    if (mouse.release) return;
+    mouse.x = mouse.x > E.gutter ? mouse.x - E.gutter : 0; // a click on a line number goes to its start
+    if (E.wrap) {
+        editorMouseWrapped();
+        return;
+    }
+    if (mouse.button == 64 || mouse.button == 65) {
+        E.rowoff += mouse.button == 64 ? -3 : 3;
+        if (E.rowoff > E.numrows) E.rowoff = E.numrows;
+        if (E.rowoff < 0) E.rowoff = 0;
+        if (E.cy < E.rowoff) E.cy = E.rowoff;
+        if (E.cy >= E.rowoff + E.screenrows) E.cy = E.rowoff + E.screenrows - 1;
+    } else if (mouse.button == 0 && mouse.y >= 0 && mouse.y < E.screenrows) {
+        E.cy = E.rowoff + mouse.y;
+        E.cx = E.cy < E.numrows ? rowRxToCx(editorRow(E.cy), E.coloff + mouse.x) : 0;
+    }
+    editorClampCursor();
+}
+
+void editorToggleWrap() {
+    E.wrap = !E.wrap;
+    if (E.wrap) {
+        docNodeStaleAll(E.doc.root); // the sums are only kept up to date with wrap on
+        E.coloff = 0;
+        E.segoff = 0;
+    }
+    editorInvalidateScreen();
+    snprintf(E.statusmsg, sizeof(E.statusmsg), E.wrap ? "Soft wrap on" : "Soft wrap off");
+    E.statusmsg_time = time(NULL);
+}
+
+/* Go to the line (and column) typed at the prompt; negative counts from
+ * the end, as in nano. The row index finds it in O(log n), and the view
+ * is centred on it, so it costs one frame however far it is. */
+void editorGotoLine() {
+    char *s = editorPrompt("Go to line (line[,column]): ", NULL);
+    if (s == NULL) return;
+    char *end;
+    long line = strtol(s, &end, 10), col = 1;
+    int ok = end != s;
+    if (ok && (*end == ',' || *end == ':')) {
+        char *cs = end + 1;
+        col = strtol(cs, &end, 10);
+        ok = end != cs;
+    }
+    ok = ok && *end == '\0';
+    free(s);
+    if (!ok) {
+        snprintf(E.statusmsg, sizeof(E.statusmsg), "Not a line number");
+        E.statusmsg_time = time(NULL);
+        return;
+    }
+    editorLoadAll();
+    if (line < 0) line += E.numrows + 1;
+    if (line > E.numrows) line = E.numrows;
+    if (line < 1) line = 1;
+    E.cy = E.numrows ? line - 1 : 0;
+    E.cx = E.cy < E.numrows && col > 1 ? rowRxToCx(editorRow(E.cy), col - 1) : 0;
+    editorClampCursor();
+
+    if (E.wrap) {
+        long top = docLinesBefore(&E.doc, E.cy) - E.screenrows / 2;
+        E.rowoff = docRowAtLine(&E.doc, top > 0 ? top : 0, &E.segoff);
+    } else {
+        E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
     }
 }
 
@@ -458,88 +5404,492 @@ void editorProcessKeypress() {
     if (c == '\x11') { // Ctrl-Q (unused) - we keep for future
         return;
     }
+    if (c == KEY_NONE) return;
+    c &= ~KEY_SHIFT; // no selection: shifted keys act like plain ones
+    if (pager.on) {
+        pagerProcessKey(c);
+        return;
+    }
 
     switch (c) {
+        case '\x04': // Ctrl-D debug info, then latency stats, then off
+            E.debug = (E.debug + 1) % 3;
+            break;
+        case 's' | KEY_ALT: // Alt-S soft wrap, as in nano
+            editorToggleWrap();
+            break;
+        case '\x07': case 'g' | KEY_ALT: // Ctrl-G / Alt-G go to line
+            editorGotoLine();
+            break;
+        case 'n' | KEY_ALT: // Alt-N line numbers
+            E.lineno = !E.lineno;
+            break;
+        case 'f' | KEY_ALT: // Alt-F follow the file as it grows
+            if (follow.on) {
+                followStop();
+            } else {
+                followStart();
+                E.cy = E.numrows > 0 ? E.numrows - 1 : 0; // at the end, to be kept there
+                editorClampCursor();
+            }
+            break;
         case '\r':
             editorInsertNewline();
             break;
-        case 127: // DEL / Backspace
+        case BACKSPACE:
         case '\b':
             editorDelChar();
             break;
+        case DEL_KEY: { // the character under the cursor
+            int cy = E.cy, cx = E.cx;
+            editorMoveCursor(ARROW_RIGHT);
+            if (E.cy != cy || E.cx != cx) editorDelChar();
+            break; }
         case '\x13': { // Ctrl-S save
             if (E.filename[0] == '\0') {
-                char *fn = editorPrompt("Save as: ");
+                char *fn = editorPrompt("Save as: ", NULL);
                 if (fn) {
                     strncpy(E.filename, fn, sizeof(E.filename)-1);
                     E.filename[sizeof(E.filename)-1] = '\0';
+                    editorSelectSyntax();
                     free(fn);
                 } else break;
             }
             editorSave(E.filename);
             break; }
+        case '\x17': // Ctrl-W search
+            editorFind();
+            break;
+        case '\x12': // Ctrl-R replace all
+            editorReplace();
+            break;
+        case '\x1a': // Ctrl-Z undo
+            editorUndo();
+            break;
+        case '\x19': // Ctrl-Y redo
+            editorRedo();
+            break;
         case '\x0f': { // Ctrl-O open
-            char *fn = editorPrompt("Open file: ");
+            char *fn = editorPrompt("Open file: ", NULL);
             if (fn) {
-                editorOpen(fn);
+                editorOpenBuffer(fn);
                 free(fn);
-                E.cx = E.cy = 0;
             }
             break; }
+        case ',' | KEY_ALT: case '<' | KEY_ALT: // previous / next buffer, as in nano
+            editorSwitchBuffer((buffers.cur + buffers.n - 1) % buffers.n);
+            break;
+        case '.' | KEY_ALT: case '>' | KEY_ALT:
+            editorSwitchBuffer((buffers.cur + 1) % buffers.n);
+            break;
         case '\x18': { // Ctrl-X exit
             if (E.dirty) {
-                char *ans = editorPrompt("Save changes before exit? (y/N): ");
+                char *ans = editorPrompt(buffers.n > 1 ? "Save changes before closing? (y/N): "
+                                                       : "Save changes before exit? (y/N): ", NULL);
                 if (ans && (ans[0] == 'y' || ans[0] == 'Y')) {
                     if (E.filename[0] == '\0') {
-                        char *fn = editorPrompt("Save as: ");
-                        if (fn) { strncpy(E.filename, fn, sizeof(E.filename)-1); free(fn); }
+                        char *fn = editorPrompt("Save as: ", NULL);
+                        if (fn) { strncpy(E.filename, fn, sizeof(E.filename)-1); editorSelectSyntax(); free(fn); }
                         else { free(ans); break; }
                     }
                     editorSave(E.filename);
                 }
                 if (ans) free(ans);
             }
+            // finish writing first; stay if that failed
+            if (editorSaveCollect(1) == -1) break;
+            swapClose(1); // saved, or the changes were thrown away
+            if (buffers.n > 1) {
+                editorCloseBuffer();
+                break;
+            }
             // exit
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
             break; }
-        case 'A' + 1000: case 'B' + 1000: case 'C' + 1000: case 'D' + 1000:
+        case ARROW_UP: case ARROW_DOWN: case ARROW_RIGHT: case ARROW_LEFT:
+        case ARROW_RIGHT | KEY_CTRL: case ARROW_LEFT | KEY_CTRL:
+        case HOME_KEY: case END_KEY: case HOME_KEY | KEY_CTRL: case END_KEY | KEY_CTRL:
+        case PAGE_UP: case PAGE_DOWN:
             editorMoveCursor(c);
             break;
+        case MOUSE_EVENT:
+            editorMouse();
+            break;
+        case KEY_PASTE: {
+            int len;
+            char *paste = editorReadPaste(&len);
+            if (len) {
+                undoLog(UNDO_INSERT, E.cy, E.cx, paste, len, 0);
+                editorInsertText(paste, len);
+            }
+            free(paste);
+            break; }
         default:
-            if (!iscntrl(c) && c < 128) {
-                editorInsertChar(c);
+            if (c == '\t' || (c < 256 && !iscntrl(c))) {
+                editorInsertChar(c); // UTF-8 arrives a byte at a time
             }
             break;
     }
 }
 
+/* Per screen row state, sized for E.screenrows */
+void editorAllocScreen() {
+    free(E.damage);
+    free(E.layout);
+    free(E.drawn_layout);
+    E.damage = calloc(E.screenrows, 1);
+    E.layout = calloc(E.screenrows, sizeof(*E.layout));
+    E.drawn_layout = calloc(E.screenrows, sizeof(*E.drawn_layout));
+    if (E.damage == NULL || E.layout == NULL || E.drawn_layout == NULL) die("calloc");
+}
+
+/* Lay the screen out for a rows x cols terminal and repaint it all */
+void editorSetSize(int rows, int cols) {
+    if (rows < 3) rows = 3;
+    if (cols < 1) cols = 1;
+    if (rows - 2 == E.screenrows && cols == E.termcols && E.damage) return;
+    if (E.wrap && cols != E.termcols) docNodeStaleAll(E.doc.root);
+    E.screenrows = rows - 2; // leave two rows for the status and message bars
+    E.termcols = E.screencols = cols;
+    E.gutter = 0; // editorUpdateGutter sizes it again
+    editorAllocScreen();
+    editorInvalidateScreen();
+    if (pager.on) pagerShow(pager.top, pager.line); // as many lines as now fit
+}
+
+/* Pick up a new terminal size, once a burst of SIGWINCH has settled */
+int editorResize() {
+    int rows, cols;
+    E.resize_due = 0;
+    int r = getWindowSize(&rows, &cols);
+    if (r == 0) editorSetSize(rows, cols);
+    return r == -1 ? -1 : 0;
+}
+
 void initEditor() {
+    simdInit();
     E.cx = 0; E.cy = 0; E.rowoff = 0; E.coloff = 0;
-    E.numrows = 0; E.rows = NULL; E.dirty = 0; E.filename[0] = '\0';
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-    // leave one row for status
-    E.screenrows -= 2;
+    E.numrows = 0; docInit(&E.doc); E.dirty = 0; E.filename[0] = '\0';
+    E.debug = 0; E.frame_writes = 0; E.frame_bytes = 0;
+    E.damage = NULL;
+    E.layout = E.drawn_layout = NULL;
+    E.lineno = E.gutter = 0;
+    E.resize_due = 0;
+    E.cpr_pending = 0;
+    int rows = 24, cols = 80; // until the terminal answers, if it has to be asked
+    if (!E.batch && getWindowSize(&rows, &cols) == -1) die("getWindowSize");
+    editorSetSize(rows, cols);
+    E.drawn_rowoff = E.drawn_coloff = 0;
+    E.wrap = E.segoff = 0;
+    editorInvalidateScreen();
+
+    makePipe(E.winchpipe);
+    makePipe(E.savepipe);
+    if (getenv("MINI_NANO_STATS")) atexit(statsDump);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+}
+
+/* Batch mode: mini_nano --batch [-j N] script file...
+ * The script is parsed once, then a worker process per CPU (or N) takes
+ * files off a shared counter and runs it over each one with no terminal:
+ * the file is opened and edited with the same row operations as the keys
+ * that do it, and written with the background save. The editor keeps one
+ * document per process, so processes rather than threads share the work;
+ * each one keeps the replace pool to a single thread. One command a line,
+ * '#' starts a comment:
+ *   goto LINE[,COL]    go to a line (negative: from the end)
+ *   find TEXT          go to the next match; if there is none, the file is
+ *                      left alone
+ *   type TEXT          insert TEXT; \n is a new line, \t a tab, \\ a '\'
+ *   newline, backspace [N], delete [N]
+ *   up|down|left|right [N], home, end
+ *   replace /FROM/TO/  replace every match (any delimiter)
+ * A file is saved only if the script changed it. */
+enum { BATCH_GOTO, BATCH_FIND, BATCH_TYPE, BATCH_KEY, BATCH_REPLACE };
+
+struct batchOp {
+    int op;
+    int key;            // BATCH_KEY: the key to press...
+    long n, col;        // ...this many times; BATCH_GOTO: line and column
+    char *s, *with;     // text, escapes expanded
+    int slen, wlen;
+};
+
+struct batchTally {
+    atomic_int next;    // index of the next file to take
+    atomic_int changed, unchanged, failed;
+};
+
+/* Expand the escapes of 'type' and 'find' text in place; returns the length */
+int batchUnescape(char *s) {
+    int n = 0;
+    for (char *p = s; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+            s[n++] = *p == 'n' ? '\n' : *p == 't' ? '\t' : *p;
+        } else {
+            s[n++] = *p;
+        }
+    }
+    s[n] = '\0';
+    return n;
+}
+
+/* Parse one line of the script into op. Returns NULL or what is wrong. */
+const char *batchParse(char *line, struct batchOp *op) {
+    static const struct { const char *name; int key; } keys[] = {
+        {"newline", '\r'}, {"backspace", BACKSPACE}, {"delete", DEL_KEY},
+        {"up", ARROW_UP}, {"down", ARROW_DOWN}, {"left", ARROW_LEFT}, {"right", ARROW_RIGHT},
+        {"home", HOME_KEY}, {"end", END_KEY},
+    };
+    char *arg = strchr(line, ' ');
+    if (arg) *arg++ = '\0';
+    else arg = line + strlen(line);
+    memset(op, 0, sizeof(*op));
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (strcmp(line, keys[i].name) != 0) continue;
+        char *end;
+        op->op = BATCH_KEY;
+        op->key = keys[i].key;
+        op->n = *arg ? strtol(arg, &end, 10) : 1;
+        if (*arg && (*end != '\0' || op->n < 0)) return "not a count";
+        return NULL;
+    }
+    if (strcmp(line, "goto") == 0) {
+        char *end;
+        op->op = BATCH_GOTO;
+        op->n = strtol(arg, &end, 10);
+        op->col = 1;
+        if (end == arg) return "not a line number";
+        if (*end == ',' || *end == ':') {
+            char *cs = end + 1;
+            op->col = strtol(cs, &end, 10);
+            if (end == cs) return "not a column";
+        }
+        return *end == '\0' ? NULL : "not a line number";
+    }
+    if (strcmp(line, "type") == 0 || strcmp(line, "find") == 0) {
+        op->op = line[0] == 't' ? BATCH_TYPE : BATCH_FIND;
+        if ((op->s = strdup(arg)) == NULL) die("strdup");
+        op->slen = batchUnescape(op->s);
+        if (op->slen == 0) return "no text";
+        if (op->op == BATCH_FIND && memchr(op->s, '\n', op->slen)) return "can't find across lines";
+        return NULL;
+    }
+    if (strcmp(line, "replace") == 0) {
+        // replace /from/to/, with whatever delimiter comes first
+        char d = arg[0];
+        char *mid = d ? strchr(arg + 1, d) : NULL;
+        char *end = mid ? strchr(mid + 1, d) : NULL;
+        if (end == NULL || end[1] != '\0') return "expected replace /from/to/";
+        *mid = *end = '\0';
+        op->op = BATCH_REPLACE;
+        if ((op->s = strdup(arg + 1)) == NULL || (op->with = strdup(mid + 1)) == NULL) die("strdup");
+        op->slen = batchUnescape(op->s);
+        op->wlen = batchUnescape(op->with);
+        if (op->slen == 0) return "nothing to replace";
+        if (memchr(op->s, '\n', op->slen) || memchr(op->with, '\n', op->wlen)) return "can't replace across lines";
+        return NULL;
+    }
+    return "unknown command";
+}
+
+/* Read the whole script; exits on the first bad line */
+struct batchOp *batchLoad(const char *path, int *nops) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+    struct batchOp *ops = NULL;
+    int n = 0, cap = 0, lineno = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, fp)) != -1) {
+        lineno++;
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '#') continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            ops = realloc(ops, sizeof(struct batchOp) * cap);
+            if (ops == NULL) die("realloc");
+        }
+        const char *err = batchParse(p, &ops[n]);
+        if (err) {
+            fprintf(stderr, "%s:%d: %s\n", path, lineno, err);
+            exit(2);
+        }
+        n++;
+    }
+    free(line);
+    fclose(fp);
+    *nops = n;
+    return ops;
+}
+
+/* Run the script over the open file. Returns 0 if a 'find' came up empty. */
+int batchRun(struct batchOp *ops, int nops) {
+    for (int i = 0; i < nops; i++) {
+        struct batchOp *op = &ops[i];
+        switch (op->op) {
+        case BATCH_GOTO: {
+            long line = op->n < 0 ? op->n + E.numrows + 1 : op->n;
+            if (line > E.numrows) line = E.numrows;
+            if (line < 1) line = 1;
+            E.cy = E.numrows ? line - 1 : 0;
+            E.cx = E.cy < E.numrows && op->col > 1 ? rowRxToCx(editorRow(E.cy), op->col - 1) : 0;
+            editorClampCursor();
+            break; }
+        case BATCH_FIND: {
+            int row, col;
+            // from the cursor on, without wrapping around
+            if (!editorFindNext(op->s, op->slen, E.cy, E.cx, &row, &col) ||
+                row < E.cy || (row == E.cy && col < E.cx)) return 0;
+            E.cy = row;
+            E.cx = col;
+            break; }
+        case BATCH_TYPE:
+            for (int k = 0; k < op->slen; k++) {
+                if (op->s[k] == '\n') editorInsertNewline();
+                else editorInsertChar((unsigned char)op->s[k]);
+            }
+            break;
+        case BATCH_KEY:
+            for (long k = 0; k < op->n; k++) {
+                if (op->key == '\r') editorInsertNewline();
+                else if (op->key == BACKSPACE) editorDelChar();
+                else if (op->key == DEL_KEY) {
+                    int cy = E.cy, cx = E.cx;
+                    editorMoveCursor(ARROW_RIGHT);
+                    if (E.cy != cy || E.cx != cx) editorDelChar();
+                } else editorMoveCursor(op->key);
+            }
+            break;
+        case BATCH_REPLACE: {
+            int nrows;
+            editorReplaceAll(op->s, op->slen, op->with, op->wlen, &nrows);
+            break; }
+        }
+    }
+    return 1;
+}
+
+/* Edit and save one file. Returns -1 on failure, 1 if it changed. */
+int batchFile(const char *path, struct batchOp *ops, int nops) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    editorOpen(path);
+    editorLoadAll();
+    E.cx = E.cy = 0;
+    if (!batchRun(ops, nops) || !E.dirty) return 0;
+    if (!editorSave(path) || editorSaveCollect(1) != 1) {
+        fprintf(stderr, "%s: %s\n", path, E.statusmsg);
+        return -1;
+    }
+    return 1;
+}
+
+int batchMain(int argc, char *argv[]) {
+    int jobs = 0;
+    if (argc > 0 && strncmp(argv[0], "-j", 2) == 0) {
+        const char *n = argv[0][2] ? argv[0] + 2 : argc > 1 ? argv[1] : "";
+        jobs = atoi(n);
+        argc -= argv[0][2] ? 1 : 2;
+        argv += argv[0][2] ? 1 : 2;
+    }
+    if (argc < 2 || jobs < 0) {
+        fprintf(stderr, "usage: mini_nano --batch [-j N] script file...\n");
+        return 2;
+    }
+    int nops;
+    struct batchOp *ops = batchLoad(argv[0], &nops);
+    char **files = argv + 1;
+    int nfiles = argc - 1;
+
+    if (jobs == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = ncpu < 1 ? 1 : ncpu > POOL_MAX ? POOL_MAX : ncpu;
+    }
+    if (jobs > nfiles) jobs = nfiles;
+    struct batchTally *t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED) die("mmap");
+    memset(t, 0, sizeof(*t));
+
+    long long t0 = monotonicUs();
+    for (int w = 0; w < jobs; w++) {
+        pid_t pid = fork();
+        if (pid == -1) die("fork");
+        if (pid > 0) continue;
+        initEditor();
+        int i;
+        while ((i = atomic_fetch_add(&t->next, 1)) < nfiles) {
+            int r = batchFile(files[i], ops, nops);
+            atomic_fetch_add(r < 0 ? &t->failed : r ? &t->changed : &t->unchanged, 1);
+        }
+        exit(0);
+    }
+    int crashed = 0, status;
+    while (wait(&status) > 0)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) crashed++;
+
+    // files a crashed worker took but never finished count as failed
+    int done = atomic_load(&t->changed) + atomic_load(&t->unchanged) + atomic_load(&t->failed);
+    int failed = atomic_load(&t->failed) + (crashed ? nfiles - done : 0);
+    printf("%d file%s: %d changed, %d unchanged, %d failed in %.2f s (%d worker%s)\n",
+           nfiles, nfiles == 1 ? "" : "s", atomic_load(&t->changed), atomic_load(&t->unchanged),
+           failed, (monotonicUs() - t0) / 1e6, jobs, jobs == 1 ? "" : "s");
+    return failed ? 1 : 0;
 }
 
+#ifndef MINI_NANO_NO_MAIN /* bench_lineindex.c includes this file */
 int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        E.batch = 1;
+        return batchMain(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+        E.mouse = 1;
+        argc--;
+        argv++;
+    }
     enableRawMode();
     initEditor();
 
-    if (argc >= 2) {
-        editorOpen(argv[1]);
-        strncpy(E.filename, argv[1], sizeof(E.filename)-1);
-        E.filename[sizeof(E.filename)-1] = '\0';
+    if (argc > 2 && strcmp(argv[1], "-R") == 0) {
+        if (!pagerOpen(argv[2])) die(argv[2]);
+    } else {
+        for (int i = 1; i < argc; i++) editorOpenBuffer(argv[i]);
+        if (argc > 2) editorSwitchBuffer(0);
     }
 
-    snprintf(E.statusmsg, sizeof(E.statusmsg), "Ctrl-S: Save | Ctrl-O: Open | Ctrl-X: Exit");
+    snprintf(E.statusmsg, sizeof(E.statusmsg), pager.on ? "Read-only | q: Quit | /: Search | g / G: Start / End"
+                                                        : "Ctrl-S: Save | Ctrl-O: Open | Ctrl-X: Exit");
     E.statusmsg_time = time(NULL);
 
     while (1) {
         editorRefreshScreen();
-        editorProcessKeypress();
+        // apply every key that is already waiting, then draw once; scrolling
+        // still follows the cursor key by key
+        do {
+            editorProcessKeypress();
+            editorScroll();
+        } while (editorInputPending());
     }
 
     return 0;
 }
+#endif